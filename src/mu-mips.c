@@ -3,6 +3,13 @@
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
 
 #include "mu-mips.h"
 
@@ -22,8 +29,35 @@ void help() {
 	printf("low <val>\t-- set the LO register to <val>\n");
 	printf("print\t-- print the program loaded into memory\n");
 	printf("show\t-- print the current content of the pipeline registers\n");
+#if MU_UNDO
+	printf("back <n>\t-- rewind the simulator by <n> cycles\n");
+	printf("rstep\t-- rewind the simulator by one cycle\n");
+	printf("undo <n>\t-- keep <n> cycles of history for back/rstep (0 disables)\n");
+#endif
+#if MU_BREAK
+	printf("break <pc>\t-- stop before the instruction at <pc> executes\n");
+	printf("cbreak <pc> <reg> <val>\t-- break at <pc> only when GPR <reg> equals <val>\n");
+	printf("watch <addr>\t-- stop when a load or store touches the word at <addr>\n");
+	printf("delete <addr>\t-- remove the breakpoints/watchpoints at <addr>\n");
+#endif
+#if MU_CAPTURE
+	printf("capture <file>\t-- record retired instructions into a trace file (\"off\" stops)\n");
+#endif
+#if MU_SWEEP
+	printf("sweep <file>\t-- write a cache miss-ratio grid for the run to a CSV file (\"off\" ends it early)\n");
+#endif
+#if MU_SLICE
+	printf("slice <k> <w>\t-- simulate to completion, timing each <k>-instruction slice in parallel after <w> warm-up instructions\n");
+#endif
+	printf("batch <n> <reg> <start> <step>\t-- run <n> copies to completion, copy i with GPR <reg> = <start> + i * <step>\n");
+	printf("replay <file>\t-- evaluate the pipeline timing models on a captured trace\n");
 	printf("?\t-- display help menu\n");
 	printf("quit\t-- exit the simulator\n\n");
+	printf("CP0 counters: MFC0/MTC0 $9 sel 0 (cycles), $25 sel 0-4 (cycles, instructions, stalls, mispredicts, cache misses)\n");
+#if !MU_PROFILE
+	printf("this build has no MU_PROFILE, so stalls and mispredicts read 0\n");
+#endif
+	printf("batch copies have no pipeline: cycles count instructions, stalls/mispredicts/misses read 0\n\n");
 	printf("------------------------------------------------------------------\n\n");
 }
 
@@ -55,6 +89,11 @@ void mem_write_32(uint32_t address, uint32_t value)
 	for (i = 0; i < NUM_MEM_REGION; i++) {
 		if ( (address >= MEM_REGIONS[i].begin) && (address <= MEM_REGIONS[i].end) ) {
 			offset = address - MEM_REGIONS[i].begin;
+#if MU_UNDO
+			if (UNDO_RECORDING) {
+				undo_record_write(address, mem_read_32(address));
+			}
+#endif
 
 			MEM_REGIONS[i].mem[offset+3] = (value >> 24) & 0xFF;
 			MEM_REGIONS[i].mem[offset+2] = (value >> 16) & 0xFF;
@@ -62,53 +101,1847 @@ void mem_write_32(uint32_t address, uint32_t value)
 			MEM_REGIONS[i].mem[offset+0] = (value >>  0) & 0xFF;
 		}
 	}
+	
+	/*keep the predecoded program coherent with stores into the text segment*/
+	offset = (address - MEM_TEXT_BEGIN) >> 2;
+	if (offset < TEXT_TABLE_SIZE && (address & 3) == 0) {
+		TEXT_TABLE[offset].IR = value;
+	}
+}
+
+/***************************************************************/
+/* Read a byte from memory                                                                                          */
+/***************************************************************/
+uint8_t mem_read_8(uint32_t address)
+{
+	return (mem_read_32(address & ~3) >> ((address & 3) * 8)) & 0xFF;
+}
+
+/***************************************************************/
+/* Write a byte to memory                                                                                              */
+/***************************************************************/
+void mem_write_8(uint32_t address, uint8_t value)
+{
+	uint32_t shift = (address & 3) * 8;
+	uint32_t word = mem_read_32(address & ~3);
+	
+	word = (word & ~(0xFF << shift)) | ((uint32_t)value << shift);
+	mem_write_32(address & ~3, word);
+}
+
+/***************************************************************/
+/* Write any buffered guest console output to stdout                                          */
+/***************************************************************/
+void output_flush()
+{
+	if (OUTPUT_LENGTH > 0) {
+		fwrite(OUTPUT_BUFFER, 1, OUTPUT_LENGTH, stdout);
+		fflush(stdout);
+		OUTPUT_LENGTH = 0;
+	}
+}
+
+/***************************************************************/
+/* Append guest console output, flushing only when the buffer fills                     */
+/***************************************************************/
+void output_write(const char *str, uint32_t len)
+{
+#if MU_UNDO
+	if (UNDO_REPLAYING) {
+		return; /*already printed the first time round*/
+	}
+#endif
+	if (OUTPUT_LENGTH + len > OUTPUT_BUFFER_SIZE) {
+		output_flush();
+	}
+	if (len > OUTPUT_BUFFER_SIZE) {
+		fwrite(str, 1, len, stdout);
+		return;
+	}
+	memcpy(OUTPUT_BUFFER + OUTPUT_LENGTH, str, len);
+	OUTPUT_LENGTH += len;
+}
+
+/***************************************************************/
+/* Execute one cycle                                                                                                              */
+/***************************************************************/
+void cycle() {                                                
+	UNDO(undo_begin_cycle());
+	handle_pipeline();
+	CURRENT_STATE = NEXT_STATE;
+	UNDO(UNDO_RECORDING = FALSE);
+	TRACE(fprintf(stderr, "[%u] IF/ID %08x ID/EX %08x EX/MEM %08x MEM/WB %08x%s%s\n", CYCLE_COUNT,
+		IF_ID.PC, ID_EX.PC, EX_MEM.PC, MEM_WB.PC, PIPE_STALL ? " stall" : "", PIPE_FLUSH ? " flush" : ""));
+	CYCLE_COUNT++;
+}
+
+/***************************************************************/
+/* Simulate MIPS for n cycles                                                                                       */
+/***************************************************************/
+void run(int num_cycles) {                                      
+	
+	if (RUN_FLAG == FALSE) {
+		printf("Simulation Stopped\n\n");
+		return;
+	}
+
+	printf("Running simulator for %d cycles...\n\n", num_cycles);
+	int i;
+	for (i = 0; i < num_cycles; i++) {
+		if (RUN_FLAG == FALSE) {
+			output_flush();
+			printf("Simulation Stopped.\n\n");
+			break;
+		}
+		cycle();
+#if MU_BREAK
+		if (BREAK_HIT) {
+			break;
+		}
+#endif
+	}
+	output_flush();
+#if MU_BREAK
+	if (BREAK_HIT) {
+		BREAK_HIT = FALSE;
+		show_pipeline();
+	}
+#endif
+}
+
+/***************************************************************/
+/* simulate to completion                                                                                               */
+/***************************************************************/
+void runAll() {                                                     
+	if (RUN_FLAG == FALSE) {
+		printf("Simulation Stopped.\n\n");
+		return;
+	}
+
+	printf("Simulation Started...\n\n");
+	while (RUN_FLAG){
+		cycle();
+#if MU_BREAK
+		if (BREAK_HIT) {
+			output_flush();
+			BREAK_HIT = FALSE;
+			show_pipeline();
+			return;
+		}
+#endif
+	}
+	output_flush();
+	printf("Simulation Finished.\n\n");
+}
+
+#if MU_UNDO
+/***************************************************************/
+/* Copy the core (registers, pipeline, counters) into a checkpoint            */
+/***************************************************************/
+void save_core(Core_State *core) {
+	core->state = CURRENT_STATE;
+	core->IF_ID = IF_ID;
+	core->ID_EX = ID_EX;
+	core->EX_MEM = EX_MEM;
+	core->MEM_WB = MEM_WB;
+	core->INSTRUCTION_COUNT = INSTRUCTION_COUNT;
+	core->CYCLE_COUNT = CYCLE_COUNT;
+	core->HEAP_END = HEAP_END;
+	memcpy(core->CP0_BASE, CP0_BASE, sizeof(CP0_BASE));
+	core->RUN_FLAG = RUN_FLAG;
+#if MU_PROFILE
+	core->STALL_COUNT = STALL_COUNT;
+	core->FLUSH_COUNT = FLUSH_COUNT;
+	core->LOAD_COUNT = LOAD_COUNT;
+	core->STORE_COUNT = STORE_COUNT;
+	core->BRANCH_COUNT = BRANCH_COUNT;
+#endif
+}
+
+/***************************************************************/
+/* Restore the core from a checkpoint                                                                     */
+/***************************************************************/
+void restore_core(const Core_State *core) {
+	CURRENT_STATE = core->state;
+	NEXT_STATE = core->state;
+	IF_ID = core->IF_ID;
+	ID_EX = core->ID_EX;
+	EX_MEM = core->EX_MEM;
+	MEM_WB = core->MEM_WB;
+	INSTRUCTION_COUNT = core->INSTRUCTION_COUNT;
+	CYCLE_COUNT = core->CYCLE_COUNT;
+	HEAP_END = core->HEAP_END;
+	memcpy(CP0_BASE, core->CP0_BASE, sizeof(CP0_BASE));
+	RUN_FLAG = core->RUN_FLAG;
+#if MU_PROFILE
+	STALL_COUNT = core->STALL_COUNT;
+	FLUSH_COUNT = core->FLUSH_COUNT;
+	LOAD_COUNT = core->LOAD_COUNT;
+	STORE_COUNT = core->STORE_COUNT;
+	BRANCH_COUNT = core->BRANCH_COUNT;
+#endif
+}
+
+/***************************************************************/
+/* Size the undo log for <window> cycles of history (0 disables it)          */
+/***************************************************************/
+void undo_configure(uint32_t window) {
+	free(UNDO_FRAMES);
+	free(UNDO_DELTAS);
+	free(UNDO_CHECKPOINT);
+	UNDO_FRAMES = NULL;
+	UNDO_DELTAS = NULL;
+	UNDO_CHECKPOINT = NULL;
+	UNDO_WINDOW = window;
+	
+	if (window > 0) {
+		UNDO_INTERVAL = (window / UNDO_CHECKPOINTS > 0) ? window / UNDO_CHECKPOINTS : 1;
+		UNDO_CHECKPOINT_SIZE = window / UNDO_INTERVAL + 2;
+		UNDO_DELTA_SIZE = window * 2 + 64;
+		UNDO_FRAMES = malloc(window * sizeof(Undo_Frame));
+		UNDO_DELTAS = malloc(UNDO_DELTA_SIZE * sizeof(Undo_Delta));
+		UNDO_CHECKPOINT = malloc(UNDO_CHECKPOINT_SIZE * sizeof(Core_State));
+		if (UNDO_FRAMES == NULL || UNDO_DELTAS == NULL || UNDO_CHECKPOINT == NULL) {
+			printf("Error: Can't allocate an undo log of %u cycles\n", window);
+			undo_configure(0);
+			return;
+		}
+	}
+	undo_clear();
+}
+
+/***************************************************************/
+/* Forget all history, the next cycle starts a new checkpoint                   */
+/***************************************************************/
+void undo_clear() {
+	UNDO_DELTA_BEGIN = UNDO_DELTA_END = 0;
+	UNDO_CHECKPOINT_COUNT = 0;
+	UNDO_FIRST_CYCLE = CYCLE_COUNT;
+	UNDO_OVERFLOW = FALSE;
+}
+
+/***************************************************************/
+/* Drop the oldest checkpoint and the frames that depend on it                */
+/***************************************************************/
+int undo_evict() {
+	if (UNDO_CHECKPOINT_COUNT < 2) {
+		return FALSE;
+	}
+	memmove(&UNDO_CHECKPOINT[0], &UNDO_CHECKPOINT[1], (UNDO_CHECKPOINT_COUNT - 1) * sizeof(Core_State));
+	UNDO_CHECKPOINT_COUNT--;
+	UNDO_FIRST_CYCLE = UNDO_CHECKPOINT[0].CYCLE_COUNT;
+	UNDO_DELTA_BEGIN = UNDO_FRAMES[UNDO_FIRST_CYCLE % UNDO_WINDOW].start;
+	return TRUE;
+}
+
+/***************************************************************/
+/* Open the undo frame of the cycle about to run                                        */
+/***************************************************************/
+void undo_begin_cycle() {
+	Undo_Frame *frame;
+	
+	if (UNDO_WINDOW == 0) {
+		return;
+	}
+	if (UNDO_OVERFLOW) {
+		undo_clear();
+	}
+	
+	if (UNDO_CHECKPOINT_COUNT == 0 ||
+		CYCLE_COUNT - UNDO_CHECKPOINT[UNDO_CHECKPOINT_COUNT - 1].CYCLE_COUNT >= UNDO_INTERVAL) {
+		if (UNDO_CHECKPOINT_COUNT == UNDO_CHECKPOINT_SIZE) {
+			undo_evict();
+		}
+		save_core(&UNDO_CHECKPOINT[UNDO_CHECKPOINT_COUNT++]);
+	}
+	if (CYCLE_COUNT - UNDO_FIRST_CYCLE >= UNDO_WINDOW && !undo_evict()) {
+		undo_clear();
+		save_core(&UNDO_CHECKPOINT[UNDO_CHECKPOINT_COUNT++]);
+	}
+	
+	frame = &UNDO_FRAMES[CYCLE_COUNT % UNDO_WINDOW];
+	frame->start = UNDO_DELTA_END;
+	frame->has_input = FALSE;
+	UNDO_RECORDING = TRUE;
+}
+
+/***************************************************************/
+/* Remember the old value of a memory word written this cycle                  */
+/***************************************************************/
+void undo_record_write(uint32_t address, uint32_t old) {
+	Undo_Delta *delta;
+	
+	/*make room by dropping whole checkpoint intervals, but never the current one*/
+	while (UNDO_DELTA_END - UNDO_DELTA_BEGIN == UNDO_DELTA_SIZE) {
+		if (UNDO_CHECKPOINT_COUNT < 2 || UNDO_CHECKPOINT[1].CYCLE_COUNT > CYCLE_COUNT || !undo_evict()) {
+			UNDO_OVERFLOW = TRUE;
+			return;
+		}
+	}
+	delta = &UNDO_DELTAS[UNDO_DELTA_END % UNDO_DELTA_SIZE];
+	delta->address = address;
+	delta->old = old;
+	UNDO_DELTA_END++;
+}
+
+/***************************************************************/
+/* Remember the value a read int syscall returned this cycle                     */
+/***************************************************************/
+void undo_record_input(int value) {
+	if (UNDO_RECORDING) {
+		UNDO_FRAMES[CYCLE_COUNT % UNDO_WINDOW].has_input = TRUE;
+		UNDO_FRAMES[CYCLE_COUNT % UNDO_WINDOW].input = value;
+	}
+}
+
+/***************************************************************/
+/* Rewind the simulator by <cycles> cycles                                                        */
+/***************************************************************/
+void undo_back(uint32_t cycles) {
+	uint32_t target, i;
+	Core_State *checkpoint;
+	
+	if (UNDO_WINDOW == 0 || UNDO_OVERFLOW || UNDO_CHECKPOINT_COUNT == 0 || CYCLE_COUNT == UNDO_FIRST_CYCLE) {
+		printf("No history to rewind.\n\n");
+		return;
+	}
+	if (cycles > CYCLE_COUNT - UNDO_FIRST_CYCLE) {
+		cycles = CYCLE_COUNT - UNDO_FIRST_CYCLE;
+		printf("Only %u cycles of history are kept.\n", cycles);
+	}
+	target = CYCLE_COUNT - cycles;
+	
+	/*newest checkpoint at or before the target*/
+	i = UNDO_CHECKPOINT_COUNT;
+	while (i > 1 && UNDO_CHECKPOINT[i - 1].CYCLE_COUNT > target) {
+		i--;
+	}
+	UNDO_CHECKPOINT_COUNT = i;
+	checkpoint = &UNDO_CHECKPOINT[i - 1];
+	
+	/*keep the syscall input of the cycles that are about to be re-simulated*/
+	UNDO_REPLAY_BASE = checkpoint->CYCLE_COUNT;
+	UNDO_REPLAY_INPUT = malloc((target - UNDO_REPLAY_BASE + 1) * sizeof(int));
+	for (i = UNDO_REPLAY_BASE; i < target; i++) {
+		Undo_Frame *frame = &UNDO_FRAMES[i % UNDO_WINDOW];
+		UNDO_REPLAY_INPUT[i - UNDO_REPLAY_BASE] = frame->has_input ? frame->input : 0;
+	}
+	
+	/*undo memory writes newest first back to the checkpoint*/
+	i = UNDO_FRAMES[UNDO_REPLAY_BASE % UNDO_WINDOW].start;
+	while (UNDO_DELTA_END > i) {
+		UNDO_DELTA_END--;
+		mem_write_32(UNDO_DELTAS[UNDO_DELTA_END % UNDO_DELTA_SIZE].address, UNDO_DELTAS[UNDO_DELTA_END % UNDO_DELTA_SIZE].old);
+	}
+	restore_core(checkpoint);
+	
+#if MU_CAPTURE
+	if (CAPTURE_FILE != NULL) {
+		printf("Rewinding ends the trace capture.\n");
+		capture_close();
+	}
+#endif
+#if MU_SWEEP
+	if (SWEEP_ACTIVE) {
+		printf("Rewinding ends the cache sweep.\n");
+		sweep_finish(); /*re-running forward would count the rewound references twice*/
+	}
+#endif
+	/*re-simulate forward, the frames are recorded again on the way*/
+	output_flush();
+	UNDO_REPLAYING = TRUE;
+	while (CYCLE_COUNT < target) {
+		cycle();
+	}
+	UNDO_REPLAYING = FALSE;
+	free(UNDO_REPLAY_INPUT);
+	UNDO_REPLAY_INPUT = NULL;
+	
+	printf("Rewound to cycle %u (PC 0x%08x).\n\n", CYCLE_COUNT, CURRENT_STATE.PC);
+}
+#endif
+
+#if MU_BREAK
+/***************************************************************/
+/* Set a breakpoint (or watchpoint when watch is TRUE)                                     */
+/***************************************************************/
+void breakpoint_add(uint32_t address, int watch, int conditional, uint32_t reg, uint32_t value) {
+	Breakpoint *bp;
+	
+	if (NUM_BREAKPOINTS == MAX_BREAKPOINTS) {
+		printf("Error: At most %d breakpoints and watchpoints can be set\n\n", MAX_BREAKPOINTS);
+		return;
+	}
+	if (!watch && ((address & 3) != 0 || ((address - MEM_TEXT_BEGIN) >> 2) >= TEXT_TABLE_SIZE)) {
+		printf("Error: 0x%08x is not an instruction of the loaded program\n\n", address);
+		return;
+	}
+	if (conditional && reg >= MIPS_REGS) {
+		printf("Error: Invalid register %u\n\n", reg);
+		return;
+	}
+	bp = &BREAKPOINTS[NUM_BREAKPOINTS++];
+	bp->address = watch ? (address & ~3) : address;
+	bp->watch = watch;
+	bp->conditional = conditional;
+	bp->reg = reg;
+	bp->value = value;
+	breakpoint_sync();
+	
+	printf("%s %d at 0x%08x", watch ? "Watchpoint" : "Breakpoint", NUM_BREAKPOINTS, bp->address);
+	if (conditional) {
+		printf(" if R%u == 0x%08x", reg, value);
+	}
+	printf("\n\n");
+}
+
+/***************************************************************/
+/* Remove every breakpoint and watchpoint on address                                  */
+/***************************************************************/
+void breakpoint_delete(uint32_t address) {
+	int i, j, removed = 0;
+	
+	for (i = 0, j = 0; i < NUM_BREAKPOINTS; i++) {
+		if (BREAKPOINTS[i].address == address || (BREAKPOINTS[i].watch && BREAKPOINTS[i].address == (address & ~3))) {
+			removed++;
+			continue;
+		}
+		BREAKPOINTS[j++] = BREAKPOINTS[i];
+	}
+	NUM_BREAKPOINTS = j;
+	breakpoint_sync();
+	printf("Deleted %d breakpoint(s)/watchpoint(s) at 0x%08x\n\n", removed, address);
+}
+
+/***************************************************************/
+/* Rebuild the predecoded breakpoint flags and the watched page flags     */
+/***************************************************************/
+void breakpoint_sync() {
+	uint32_t i;
+	int j;
+	
+	for (i = 0; i < TEXT_TABLE_SIZE; i++) {
+		TEXT_TABLE[i].flags &= ~PREDECODED_BREAK;
+	}
+	memset(WATCH_PAGES, 0, sizeof(WATCH_PAGES));
+	
+	for (j = 0; j < NUM_BREAKPOINTS; j++) {
+		if (BREAKPOINTS[j].watch) {
+			WATCH_PAGES[BREAKPOINTS[j].address >> WATCH_PAGE_BITS] = 1;
+			continue;
+		}
+		i = (BREAKPOINTS[j].address - MEM_TEXT_BEGIN) >> 2;
+		if (i < TEXT_TABLE_SIZE) {
+			TEXT_TABLE[i].flags |= PREDECODED_BREAK;
+		}
+	}
+}
+
+/***************************************************************/
+/* Value of reg in program order just before the instruction leaving ID,    */
+/* FALSE while an older load or late writer has not produced it yet         */
+/***************************************************************/
+int breakpoint_register(uint32_t reg, uint32_t *value) {
+	/*EX_MEM holds the next older instruction and MEM_WB the one before, the rest have written back*/
+	Inst_Deps d = decode_deps(EX_MEM.IR);
+	
+	if (reg != 0 && d.dest == reg) {
+		*value = EX_MEM.ALUOutput;
+		return (d.kind == INST_ALU);
+	}
+	d = decode_deps(MEM_WB.IR);
+	if (reg != 0 && d.dest == reg) {
+		*value = (d.kind == INST_LOAD) ? MEM_WB.LMD : MEM_WB.ALUOutput;
+		return (d.kind == INST_ALU || d.kind == INST_LOAD);
+	}
+	*value = NEXT_STATE.REGS[reg];
+	return TRUE;
+}
+
+/***************************************************************/
+/* Slow path: a flagged instruction is leaving ID, or reached MEM with  */
+/* a condition ID could not evaluate yet (late)                                         */
+/***************************************************************/
+void breakpoint_check(uint32_t pc, int late) {
+	uint32_t value;
+	int i;
+	
+#if MU_UNDO
+	if (UNDO_REPLAYING) {
+		return;
+	}
+#endif
+	for (i = 0; i < NUM_BREAKPOINTS; i++) {
+		Breakpoint *bp = &BREAKPOINTS[i];
+		if (bp->watch || bp->address != pc || (late && !bp->conditional)) {
+			continue;
+		}
+		if (bp->conditional) {
+			if (late) {
+				value = NEXT_STATE.REGS[bp->reg]; /*every older instruction wrote back in WB this cycle*/
+			}
+			else if (!breakpoint_register(bp->reg, &value)) {
+				ID_EX.flags |= PREDECODED_BREAK_LATE;
+				continue;
+			}
+			if (value != bp->value) {
+				continue;
+			}
+		}
+		output_flush();
+		printf("Breakpoint %d hit at 0x%08x (cycle %u)\n\n", i + 1, pc, CYCLE_COUNT);
+		BREAK_HIT = TRUE;
+		return;
+	}
+}
+
+/***************************************************************/
+/* Slow path: MEM accesses a page that holds a watchpoint                          */
+/***************************************************************/
+void watchpoint_check(uint32_t address, uint32_t size, int write) {
+	int i;
+	
+#if MU_UNDO
+	if (UNDO_REPLAYING) {
+		return;
+	}
+#endif
+	for (i = 0; i < NUM_BREAKPOINTS; i++) {
+		Breakpoint *bp = &BREAKPOINTS[i];
+		if (!bp->watch || address >= bp->address + 4 || address + size <= bp->address) {
+			continue;
+		}
+		/*WB ran first this cycle, so REGS already holds every older instruction's result*/
+		if (bp->conditional && NEXT_STATE.REGS[bp->reg] != bp->value) {
+			continue;
+		}
+		output_flush();
+		printf("Watchpoint %d hit: %s of 0x%08x by 0x%08x (cycle %u)", i + 1, write ? "store" : "load",
+			address, EX_MEM.PC, CYCLE_COUNT);
+		if (write) {
+			printf(", value 0x%08x", EX_MEM.B);
+		}
+		printf("\n\n");
+		BREAK_HIT = TRUE;
+		return;
+	}
+}
+#endif
+
+#if MU_CAPTURE
+/***************************************************************/
+/* Start recording retired instructions into a trace file                              */
+/***************************************************************/
+void capture_open(const char *path) {
+	uint32_t i;
+	
+	if (CAPTURE_FILE != NULL) {
+		capture_close();
+	}
+	CAPTURE_FILE = fopen(path, "wb");
+	if (CAPTURE_FILE == NULL) {
+		printf("Error: Can't open trace file %s\n\n", path);
+		return;
+	}
+	setvbuf(CAPTURE_FILE, NULL, _IOFBF, 1 << 20);
+	
+	memset(&CAPTURE_HEADER, 0, sizeof(CAPTURE_HEADER));
+	CAPTURE_HEADER.magic = TRACE_MAGIC;
+	CAPTURE_HEADER.version = TRACE_VERSION;
+	CAPTURE_HEADER.text_begin = MEM_TEXT_BEGIN;
+	CAPTURE_HEADER.text_words = TEXT_TABLE_SIZE;
+	CAPTURE_HEADER.forwarding = MU_FORWARDING;
+	CAPTURE_IMAGE = malloc((TEXT_TABLE_SIZE + 1) * sizeof(uint32_t));
+	for (i = 0; i < TEXT_TABLE_SIZE; i++) {
+		CAPTURE_IMAGE[i] = TEXT_TABLE[i].IR;
+	}
+	fwrite(&CAPTURE_HEADER, sizeof(CAPTURE_HEADER), 1, CAPTURE_FILE); /*rewritten on close*/
+	fwrite(CAPTURE_IMAGE, sizeof(uint32_t), TEXT_TABLE_SIZE, CAPTURE_FILE);
+	
+	CAPTURE_NEXT_PC = 0;
+	CAPTURE_LAST_ADDRESS = 0;
+	CAPTURE_RUN = 0;
+	CAPTURE_START_CYCLE = CYCLE_COUNT;
+	printf("Capturing retired instructions into %s\n\n", path);
+}
+
+/***************************************************************/
+/* Finish the trace file                                                                                              */
+/***************************************************************/
+void capture_close() {
+	if (CAPTURE_FILE == NULL) {
+		return;
+	}
+	if (CAPTURE_RUN > 0) {
+		capture_byte(TRACE_RUN | CAPTURE_RUN);
+		CAPTURE_RUN = 0;
+	}
+	/*the exit syscall retires in the cycle being simulated, count it*/
+	CAPTURE_HEADER.cycles = CYCLE_COUNT - CAPTURE_START_CYCLE + (RUN_FLAG ? 0 : 1);
+	fseek(CAPTURE_FILE, 0, SEEK_SET);
+	fwrite(&CAPTURE_HEADER, sizeof(CAPTURE_HEADER), 1, CAPTURE_FILE);
+	fclose(CAPTURE_FILE);
+	CAPTURE_FILE = NULL;
+	free(CAPTURE_IMAGE);
+	CAPTURE_IMAGE = NULL;
+	
+	output_flush();
+	printf("Trace capture finished: %u instructions, %u cycles, %u bytes of records\n\n",
+		CAPTURE_HEADER.records, CAPTURE_HEADER.cycles, CAPTURE_HEADER.data_bytes);
+}
+
+/***************************************************************/
+/* Append one byte to the record stream                                                           */
+/***************************************************************/
+void capture_byte(uint8_t value) {
+	putc(value, CAPTURE_FILE);
+	CAPTURE_HEADER.data_bytes++;
+}
+
+/***************************************************************/
+/* Append an unsigned LEB128 varint to the record stream                           */
+/***************************************************************/
+void capture_varint(uint32_t value) {
+	while (value >= 0x80) {
+		capture_byte((value & 0x7F) | 0x80);
+		value >>= 7;
+	}
+	capture_byte(value);
+}
+
+/***************************************************************/
+/* Record the instruction in MEM/WB, called from WB as it retires          */
+/***************************************************************/
+void capture_retire() {
+	uint32_t pc = MEM_WB.PC;
+	uint32_t instruction = MEM_WB.IR;
+	uint32_t index = (pc - MEM_TEXT_BEGIN) >> 2;
+	uint32_t expected = CAPTURE_NEXT_PC;
+	uint32_t flags = 0;
+	int32_t delta;
+	
+#if MU_UNDO
+	if (UNDO_REPLAYING) {
+		return;
+	}
+#endif
+	if (pc != expected) {
+		flags |= TRACE_PC;
+	}
+	if (index >= CAPTURE_HEADER.text_words || (pc & 3) != 0 || CAPTURE_IMAGE[index] != instruction) {
+		flags |= TRACE_IR;
+	}
+	switch(OPCODE(instruction))
+	{
+		case 0x20: case 0x21: case 0x23: //loads
+		case 0x28: case 0x29: case 0x2B: //stores
+			flags |= TRACE_MEM;
+			break;
+	}
+	if (MEM_WB.taken) {
+		flags |= TRACE_TAKEN;
+	}
+	CAPTURE_HEADER.records++;
+	CAPTURE_NEXT_PC = pc + 4;
+	
+	if (flags == 0) {
+		if (++CAPTURE_RUN == 0x7F) {
+			capture_byte(TRACE_RUN | CAPTURE_RUN);
+			CAPTURE_RUN = 0;
+		}
+		return;
+	}
+	if (CAPTURE_RUN > 0) {
+		capture_byte(TRACE_RUN | CAPTURE_RUN);
+		CAPTURE_RUN = 0;
+	}
+	capture_byte(flags);
+	if (flags & TRACE_PC) {
+		delta = (int32_t)(pc - expected);
+		capture_varint(((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+	}
+	if (flags & TRACE_IR) {
+		capture_byte(instruction & 0xFF);
+		capture_byte((instruction >> 8) & 0xFF);
+		capture_byte((instruction >> 16) & 0xFF);
+		capture_byte((instruction >> 24) & 0xFF);
+	}
+	if (flags & TRACE_MEM) {
+		delta = (int32_t)(MEM_WB.ALUOutput - CAPTURE_LAST_ADDRESS);
+		capture_varint(((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+		CAPTURE_LAST_ADDRESS = MEM_WB.ALUOutput;
+	}
+}
+#endif
+
+/***************************************************************/
+/* Read an unsigned LEB128 varint from a trace record stream                      */
+/***************************************************************/
+uint32_t trace_varint(const uint8_t **p, const uint8_t *end) {
+	uint32_t value = 0;
+	int shift = 0;
+	
+	while (*p < end && shift < 35) {
+		uint8_t byte = *(*p)++;
+		value |= (uint32_t)(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0) {
+			break;
+		}
+		shift += 7;
+	}
+	return value;
+}
+
+/***************************************************************/
+/* Advance one timing model by one retired instruction                                */
+/* Mirrors the pipeline: ID waits for its operands and for fetch to be       */
+/* redirected, results reach ID three cycles after the producer left ID   */
+/* (one cycle for forwarded ALU results, two for loads and WB results).   */
+/***************************************************************/
+void replay_step(Replay_Config *config, const Trace_Record *record, Inst_Deps deps) {
+	uint32_t issue = config->last + 1;	/*cycle the instruction leaves ID*/
+	uint32_t need, i;
+	uint8_t srcs[2];
+	int control = FALSE, predicted = FALSE;
+	
+	if (issue < config->redirect) {
+		issue = config->redirect;
+	}
+	srcs[0] = deps.src1;
+	srcs[1] = deps.src2;
+	for (i = 0; i < 2; i++) {
+		if (srcs[i] == 0 || config->kind[srcs[i]] == INST_NONE) {
+			continue;
+		}
+		if (!config->forwarding) {
+			need = config->ready[srcs[i]] + 3;
+		}
+		else if (config->kind[srcs[i]] != INST_ALU) {
+			need = config->ready[srcs[i]] + 2;
+		}
+		else {
+			need = 0;
+		}
+		if (issue < need) {
+			config->stalls += need - issue;
+			issue = need;
+		}
+	}
+	if (deps.kind != INST_NONE) {
+		config->ready[deps.dest] = issue;
+		config->kind[deps.dest] = deps.kind;
+	}
+	
+	switch(OPCODE(record->IR))
+	{
+		case 0x01: case 0x04: case 0x05: case 0x06: case 0x07: //conditional branches
+			control = TRUE;
+			predicted = config->btfn && (SIMM(record->IR) & 0x80000000);
+			break;
+		case 0x02: case 0x03: //J, JAL
+			control = TRUE;
+			predicted = config->btfn;
+			break;
+		case 0x00:
+			control = (FUNCT(record->IR) == 0x08 || FUNCT(record->IR) == 0x09); //JR, JALR
+			break;
+	}
+	if (control) {
+		if (predicted != record->taken) {
+			config->mispredicts++;
+			config->redirect = issue + 1 + config->penalty;
+		}
+		else if (record->taken) {
+			config->redirect = issue + 2; /*target known after decode*/
+		}
+	}
+	config->last = issue;
+}
+
+/***************************************************************/
+/* Drive the timing models straight from a captured trace                           */
+/***************************************************************/
+void replay_trace(const char *path) {
+	Replay_Config configs[12];
+	Trace_Record record;
+	const Trace_Header *header;
+	Trace_Header info;
+	Inst_Deps deps;
+	const uint32_t *image;
+	const uint8_t *p, *end;
+	uint8_t *base;
+	struct stat st;
+	uint32_t count, index, records = 0;
+	int fd, n = 0, forwarding, btfn, penalty, i;
+	int32_t delta;
+	
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("Error: Can't open trace file %s\n\n", path);
+		return;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Trace_Header)) {
+		printf("Error: %s is not a trace file\n\n", path);
+		close(fd);
+		return;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		printf("Error: Can't map trace file %s\n\n", path);
+		return;
+	}
+	header = (const Trace_Header *)base;
+	image = (const uint32_t *)(base + sizeof(Trace_Header));
+	p = (const uint8_t *)(image + header->text_words);
+	end = p + header->data_bytes;
+	if (header->magic != TRACE_MAGIC || header->version != TRACE_VERSION ||
+		(uint64_t)sizeof(Trace_Header) + (uint64_t)header->text_words * 4 + header->data_bytes > (uint64_t)st.st_size) {
+		printf("Error: %s is not a trace file\n\n", path);
+		munmap(base, st.st_size);
+		return;
+	}
+	
+	/*every config sees the same stream, so one pass evaluates them all*/
+	for (forwarding = 1; forwarding >= 0; forwarding--) {
+		for (btfn = 0; btfn <= 1; btfn++) {
+			for (penalty = 1; penalty <= 3; penalty++) {
+				memset(&configs[n], 0, sizeof(Replay_Config));
+				configs[n].forwarding = forwarding;
+				configs[n].btfn = btfn;
+				configs[n].penalty = penalty;
+				n++;
+			}
+		}
+	}
+	
+	record.PC = 0;
+	record.address = 0;
+	while (p < end) {
+		count = 1;
+		if (*p & TRACE_RUN) {
+			count = *p++ & 0x7F;
+			record.taken = FALSE;
+		}
+		else {
+			uint8_t flags = *p++;
+			if (flags & TRACE_PC) {
+				delta = (int32_t)trace_varint(&p, end);
+				record.PC += (uint32_t)((delta >> 1) ^ -(delta & 1));
+			}
+			if (flags & TRACE_IR) {
+				if (end - p < 4) {
+					break;
+				}
+				record.IR = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+				p += 4;
+			}
+			if (flags & TRACE_MEM) {
+				delta = (int32_t)trace_varint(&p, end);
+				record.address += (uint32_t)((delta >> 1) ^ -(delta & 1));
+			}
+			record.taken = (flags & TRACE_TAKEN) != 0;
+			if (!(flags & TRACE_IR)) {
+				index = (record.PC - header->text_begin) >> 2;
+				record.IR = (index < header->text_words) ? image[index] : 0;
+			}
+			deps = decode_deps(record.IR);
+			for (i = 0; i < n; i++) {
+				replay_step(&configs[i], &record, deps);
+			}
+			record.PC += 4;
+			records++;
+			continue;
+		}
+		while (count-- > 0) {
+			index = (record.PC - header->text_begin) >> 2;
+			record.IR = (index < header->text_words) ? image[index] : 0;
+			deps = decode_deps(record.IR);
+			for (i = 0; i < n; i++) {
+				replay_step(&configs[i], &record, deps);
+			}
+			record.PC += 4;
+			records++;
+		}
+	}
+	info = *header;
+	munmap(base, st.st_size);
+	
+	printf("-------------------------------------------------------------\n");
+	printf("Replayed %u instructions from %s (%.2f bits/instruction)\n", records, path,
+		records ? (info.data_bytes * 8.0) / records : 0.0);
+	printf("Captured run: %u cycles, forwarding %s\n", info.cycles, info.forwarding ? "on" : "off");
+	printf("-------------------------------------------------------------\n");
+	printf("[Forwarding]\t[Predictor]\t[Penalty]\t[Cycles]\t[CPI]\t[Stalls]\t[Mispredicts]\n");
+	for (i = 0; i < n; i++) {
+		configs[i].cycles = records ? configs[i].last + 4 : 0;
+		printf("%s\t\t%s\t%u\t\t%u\t\t%.3f\t%u\t\t%u%s\n", configs[i].forwarding ? "on" : "off",
+			configs[i].btfn ? "btfn\t" : "not-taken", configs[i].penalty, configs[i].cycles,
+			records ? (double)configs[i].cycles / records : 0.0, configs[i].stalls, configs[i].mispredicts,
+			(configs[i].forwarding == (int)info.forwarding && !configs[i].btfn && configs[i].penalty == 2) ? "\t(pipeline)" : "");
+	}
+	printf("-------------------------------------------------------------\n\n");
+}
+
+#if MU_SWEEP
+/***************************************************************/
+/* Start observing the reference stream, the CSV goes to path                  */
+/***************************************************************/
+void sweep_start(const char *path) {
+	int stream, k;
+	
+	for (stream = 0; stream < 2; stream++) {
+		Sweep_Stream *s = &SWEEP_STREAMS[stream];
+		for (k = 0; k <= SWEEP_SET_BITS; k++) {
+			free(s->stacks[k]);
+			s->stacks[k] = calloc((size_t)SWEEP_MAX_ASSOC << k, sizeof(uint32_t));
+			if (s->stacks[k] == NULL) {
+				printf("Error: Can't allocate the cache sweep\n\n");
+				return;
+			}
+		}
+		memset(s->distance, 0, sizeof(s->distance));
+		s->accesses = 0;
+	}
+	strncpy(SWEEP_PATH, path, sizeof(SWEEP_PATH) - 1);
+	SWEEP_ACTIVE = TRUE;
+	printf("Cache sweep started, miss ratios go to %s\n\n", SWEEP_PATH);
+}
+
+/***************************************************************/
+/* Push one reference through the LRU stack of every set count              */
+/***************************************************************/
+void sweep_access(Sweep_Stream *stream, uint32_t address) {
+	uint32_t block = (address >> SWEEP_BLOCK_BITS) + 1;
+	uint32_t *stack;
+	int k, d;
+	
+#if MU_UNDO
+	if (UNDO_REPLAYING) {
+		return;
+	}
+#endif
+	stream->accesses++;
+	for (k = 0; k <= SWEEP_SET_BITS; k++) {
+		stack = stream->stacks[k] + ((block - 1) & ((1u << k) - 1)) * SWEEP_MAX_ASSOC;
+		for (d = 0; d < SWEEP_MAX_ASSOC && stack[d] != block; d++) {
+			if (stack[d] == 0) {
+				d = SWEEP_MAX_ASSOC; /*rest of the stack is empty*/
+				break;
+			}
+		}
+		stream->distance[k][d]++;
+		if (d == SWEEP_MAX_ASSOC) {
+			d = SWEEP_MAX_ASSOC - 1; /*evict the LRU entry*/
+		}
+		memmove(stack + 1, stack, d * sizeof(uint32_t));
+		stack[0] = block;
+	}
+}
+
+/***************************************************************/
+/* Write the miss-ratio grid and stop observing                                           */
+/***************************************************************/
+void sweep_finish() {
+	static const char *names[2] = { "inst", "data" };
+	FILE *fp;
+	uint64_t misses;
+	int stream, k, assoc, d;
+	
+	if (!SWEEP_ACTIVE) {
+		return;
+	}
+	SWEEP_ACTIVE = FALSE;
+	fp = fopen(SWEEP_PATH, "w");
+	if (fp == NULL) {
+		printf("Error: Can't open %s\n\n", SWEEP_PATH);
+		return;
+	}
+	fprintf(fp, "stream,block_bytes,sets,assoc,size_bytes,accesses,misses,miss_ratio\n");
+	for (stream = 0; stream < 2; stream++) {
+		Sweep_Stream *s = &SWEEP_STREAMS[stream];
+		for (k = 0; k <= SWEEP_SET_BITS; k++) {
+			for (assoc = 1; assoc <= SWEEP_MAX_ASSOC; assoc <<= 1) {
+				/*a reference misses in an assoc-way cache when its stack distance is at least assoc*/
+				misses = 0;
+				for (d = assoc; d <= SWEEP_MAX_ASSOC; d++) {
+					misses += s->distance[k][d];
+				}
+				fprintf(fp, "%s,%u,%u,%d,%u,%llu,%llu,%.6f\n", names[stream], 1u << SWEEP_BLOCK_BITS, 1u << k, assoc,
+					(1u << (SWEEP_BLOCK_BITS + k)) * assoc, (unsigned long long)s->accesses,
+					(unsigned long long)misses, s->accesses ? (double)misses / s->accesses : 0.0);
+			}
+		}
+	}
+	fclose(fp);
+	output_flush();
+	printf("Cache sweep written to %s (%llu fetches, %llu data accesses)\n\n", SWEEP_PATH,
+		(unsigned long long)SWEEP_STREAMS[SWEEP_INST].accesses, (unsigned long long)SWEEP_STREAMS[SWEEP_DATA].accesses);
+}
+#endif
+
+/***************************************************************/
+/* Find a lane's private copy of the page holding address                            */
+/* A write allocates the copy, a read of an unwritten page returns NULL */
+/***************************************************************/
+uint8_t *batch_page(Batch_State *b, uint32_t lane, uint32_t address, int write) {
+	Batch_Pages *pages = &b->pages[lane];
+	uint32_t key = (address >> BATCH_PAGE_BITS) + 1;
+	uint32_t slot, i, base;
+	int region;
+	
+	if (pages->size > 0) {
+		for (slot = (key * 2654435761u) & (pages->size - 1); pages->keys[slot] != 0; slot = (slot + 1) & (pages->size - 1)) {
+			if (pages->keys[slot] == key) {
+				return pages->data[slot];
+			}
+		}
+	}
+	if (!write) {
+		return NULL;
+	}
+	for (region = 0; region < NUM_MEM_REGION; region++) {
+		if (address >= MEM_REGIONS[region].begin && address <= MEM_REGIONS[region].end) {
+			break;
+		}
+	}
+	if (region == NUM_MEM_REGION) {
+		return NULL; /*unmapped, writes are dropped like mem_write_32 does*/
+	}
+	
+	/*grow at 50% load*/
+	if ((pages->used + 1) * 2 > pages->size) {
+		Batch_Pages grown;
+		grown.size = pages->size ? pages->size * 2 : 16;
+		grown.used = pages->used;
+		grown.keys = calloc(grown.size, sizeof(uint32_t));
+		grown.data = calloc(grown.size, sizeof(uint8_t *));
+		for (i = 0; i < pages->size; i++) {
+			if (pages->keys[i] == 0) {
+				continue;
+			}
+			for (slot = (pages->keys[i] * 2654435761u) & (grown.size - 1); grown.keys[slot] != 0; slot = (slot + 1) & (grown.size - 1));
+			grown.keys[slot] = pages->keys[i];
+			grown.data[slot] = pages->data[i];
+		}
+		free(pages->keys);
+		free(pages->data);
+		*pages = grown;
+	}
+	for (slot = (key * 2654435761u) & (pages->size - 1); pages->keys[slot] != 0; slot = (slot + 1) & (pages->size - 1));
+	pages->keys[slot] = key;
+	pages->data[slot] = malloc(1 << BATCH_PAGE_BITS);
+	pages->used++;
+	base = address & ~((1u << BATCH_PAGE_BITS) - 1);
+	for (i = 0; i < (1u << BATCH_PAGE_BITS); i += 4) {
+		uint32_t word = mem_read_32(base + i);
+		memcpy(pages->data[slot] + i, &word, 4);
+	}
+	return pages->data[slot];
+}
+
+/***************************************************************/
+/* Read a word as seen by one lane                                                                 */
+/***************************************************************/
+uint32_t batch_read_32(Batch_State *b, uint32_t lane, uint32_t address) {
+	uint32_t offset = address & ((1u << BATCH_PAGE_BITS) - 1);
+	uint32_t shift = (address & 3) * 8;
+	uint32_t word;
+	uint8_t *page;
+	
+	if (offset > (1u << BATCH_PAGE_BITS) - 4) {
+		/*straddles two pages, either of which may be private*/
+		return batch_read_32(b, lane, address & ~3) >> shift |
+			batch_read_32(b, lane, (address & ~3) + 4) << (32 - shift);
+	}
+	page = batch_page(b, lane, address, FALSE);
+	if (page == NULL) {
+		return mem_read_32(address);
+	}
+	memcpy(&word, page + offset, 4);
+	return word;
+}
+
+/***************************************************************/
+/* Write a word into one lane's private memory                                          */
+/***************************************************************/
+void batch_write_32(Batch_State *b, uint32_t lane, uint32_t address, uint32_t value) {
+	uint32_t offset = address & ((1u << BATCH_PAGE_BITS) - 1);
+	uint32_t i, shift, word;
+	uint8_t *page;
+	
+	if (offset > (1u << BATCH_PAGE_BITS) - 4) {
+		/*straddles two pages, merge byte by byte into the aligned words*/
+		for (i = 0; i < 4; i++) {
+			shift = ((address + i) & 3) * 8;
+			word = batch_read_32(b, lane, (address + i) & ~3);
+			word = (word & ~(0xFFu << shift)) | (((value >> (i * 8)) & 0xFF) << shift);
+			batch_write_32(b, lane, (address + i) & ~3, word);
+		}
+		return;
+	}
+	page = batch_page(b, lane, address, TRUE);
+	if (page != NULL) {
+		memcpy(page + offset, &value, 4);
+	}
+}
+
+/***************************************************************/
+/* SYSCALL for one lane, output lines are tagged with the lane number     */
+/***************************************************************/
+void batch_syscall(Batch_State *b, uint32_t lane) {
+	char text[32];
+	uint32_t address, word;
+	uint8_t c;
+	int value;
+	
+	switch(b->REGS[2][lane])
+	{
+		case 1: //print int
+			output_write(text, snprintf(text, sizeof(text), "[%u] %d\n", lane, (int32_t)b->REGS[4][lane]));
+			break;
+		case 4: //print string
+			output_write(text, snprintf(text, sizeof(text), "[%u] ", lane));
+			for (address = b->REGS[4][lane]; ; address++) {
+				word = batch_read_32(b, lane, address & ~3);
+				c = (word >> ((address & 3) * 8)) & 0xFF;
+				if (c == 0) {
+					break;
+				}
+				output_write((char *)&c, 1);
+			}
+			output_write("\n", 1);
+			break;
+		case 5: //read int
+			output_flush();
+			if (scanf("%d", &value) != 1) {
+				value = 0;
+			}
+			b->REGS[2][lane] = value;
+			break;
+		case 9: //sbrk
+			b->REGS[2][lane] = b->HEAP[lane];
+			b->HEAP[lane] += (b->REGS[4][lane] + 3) & ~3;
+			break;
+		case 10: //exit
+			b->done[lane] = TRUE;
+			break;
+		default:
+			output_flush();
+			printf("Lane %u: unknown syscall %u\n", lane, b->REGS[2][lane]);
+			break;
+	}
+}
+
+/* per-lane loop over the lanes in b->mask; lanes are independent, so it is */
+/* a simd loop even when rd aliases rs or rt (each lane reads before it writes) */
+#define BATCH_LANES(stmt) _Pragma("omp simd") for (l = 0; l < n; l++) { stmt; }
+#define BATCH_SET(dst, value) (dst)[l] = ((dst)[l] & ~m[l]) | ((value) & m[l])
+
+/***************************************************************/
+/* Execute one instruction on every lane in b->mask                                    */
+/***************************************************************/
+BATCH_CLONES void batch_execute(Batch_State *b, uint32_t pc, uint32_t instruction) {
+	const uint32_t n = b->lanes;
+	const uint32_t *m = b->mask;
+	const uint32_t *rs = b->REGS[RS(instruction)];
+	const uint32_t *rt = b->REGS[RT(instruction)];
+	uint32_t *rd = b->REGS[RD(instruction)];
+	uint32_t *rtw = b->REGS[RT(instruction)];
+	uint32_t *pcs = b->PC;
+	const uint32_t sa = SA(instruction);
+	const uint32_t simm = SIMM(instruction);
+	const uint32_t imm = IMM(instruction);
+	const uint32_t next = pc + 4;
+	const uint32_t branch = pc + 4 + (simm << 2);
+	uint32_t l, address, word, shift;
+	uint64_t product;
+	int writes_rd = (RD(instruction) != 0), writes_rt = (RT(instruction) != 0);
+	
+	/*most instructions fall through, control flow overrides the PC below*/
+	BATCH_LANES(BATCH_SET(pcs, next));
+	BATCH_LANES(b->count[l] += m[l] & 1);
+	
+	switch(OPCODE(instruction))
+	{
+		case 0x00: //special
+		{
+			if (!writes_rd && FUNCT(instruction) < 0x08) {
+				break; /*shift into $0, no effect*/
+			}
+			switch(FUNCT(instruction))
+			{
+				case 0x00: //SLL
+					BATCH_LANES(BATCH_SET(rd, rt[l] << sa));
+					break;
+				case 0x02: //SRL
+					BATCH_LANES(BATCH_SET(rd, rt[l] >> sa));
+					break;
+				case 0x03: //SRA
+					BATCH_LANES(BATCH_SET(rd, (uint32_t)((int32_t)rt[l] >> sa)));
+					break;
+				case 0x08: //JR
+					BATCH_LANES(BATCH_SET(pcs, rs[l]));
+					break;
+				case 0x09: //JALR
+					BATCH_LANES(BATCH_SET(pcs, rs[l]));
+					if (writes_rd) BATCH_LANES(BATCH_SET(rd, next));
+					break;
+				case 0x0C: //SYSCALL
+					for (l = 0; l < n; l++) {
+						if (m[l]) {
+							batch_syscall(b, l);
+						}
+					}
+					break;
+				case 0x10: //MFHI
+					if (writes_rd) BATCH_LANES(BATCH_SET(rd, b->HI[l]));
+					break;
+				case 0x12: //MFLO
+					if (writes_rd) BATCH_LANES(BATCH_SET(rd, b->LO[l]));
+					break;
+				case 0x11: //MTHI
+					BATCH_LANES(BATCH_SET(b->HI, rs[l]));
+					break;
+				case 0x13: //MTLO
+					BATCH_LANES(BATCH_SET(b->LO, rs[l]));
+					break;
+				case 0x18: //MULT
+					for (l = 0; l < n; l++) {
+						product = (uint64_t)((int64_t)(int32_t)rs[l] * (int64_t)(int32_t)rt[l]);
+						BATCH_SET(b->HI, (uint32_t)(product >> 32));
+						BATCH_SET(b->LO, (uint32_t)product);
+					}
+					break;
+				case 0x19: //MULTU
+					for (l = 0; l < n; l++) {
+						product = (uint64_t)rs[l] * (uint64_t)rt[l];
+						BATCH_SET(b->HI, (uint32_t)(product >> 32));
+						BATCH_SET(b->LO, (uint32_t)product);
+					}
+					break;
+				case 0x1A: //DIV
+				case 0x1B: //DIVU
+					for (l = 0; l < n; l++) {
+						if (m[l]) {
+							alu_divide(rs[l], rt[l], FUNCT(instruction) == 0x1A, &b->HI[l], &b->LO[l]);
+						}
+					}
+					break;
+				case 0x20: //ADD
+				case 0x21: //ADDU
+					if (writes_rd) BATCH_LANES(BATCH_SET(rd, rs[l] + rt[l]));
+					break;
+				case 0x22: //SUB
+				case 0x23: //SUBU
+					if (writes_rd) BATCH_LANES(BATCH_SET(rd, rs[l] - rt[l]));
+					break;
+				case 0x24: //AND
+					if (writes_rd) BATCH_LANES(BATCH_SET(rd, rs[l] & rt[l]));
+					break;
+				case 0x25: //OR
+					if (writes_rd) BATCH_LANES(BATCH_SET(rd, rs[l] | rt[l]));
+					break;
+				case 0x26: //XOR
+					if (writes_rd) BATCH_LANES(BATCH_SET(rd, rs[l] ^ rt[l]));
+					break;
+				case 0x27: //NOR
+					if (writes_rd) BATCH_LANES(BATCH_SET(rd, ~(rs[l] | rt[l])));
+					break;
+				case 0x2A: //SLT
+					if (writes_rd) BATCH_LANES(BATCH_SET(rd, (uint32_t)((int32_t)rs[l] < (int32_t)rt[l])));
+					break;
+			}
+			break;
+		}
+		case 0x01: //BLTZ, BGEZ
+			if (RT(instruction) == 0x01) {
+				BATCH_LANES(BATCH_SET(pcs, ((int32_t)rs[l] >= 0) ? branch : next));
+			}
+			else {
+				BATCH_LANES(BATCH_SET(pcs, ((int32_t)rs[l] < 0) ? branch : next));
+			}
+			break;
+		case 0x04: //BEQ
+			BATCH_LANES(BATCH_SET(pcs, (rs[l] == rt[l]) ? branch : next));
+			break;
+		case 0x05: //BNE
+			BATCH_LANES(BATCH_SET(pcs, (rs[l] != rt[l]) ? branch : next));
+			break;
+		case 0x06: //BLEZ
+			BATCH_LANES(BATCH_SET(pcs, ((int32_t)rs[l] <= 0) ? branch : next));
+			break;
+		case 0x07: //BGTZ
+			BATCH_LANES(BATCH_SET(pcs, ((int32_t)rs[l] > 0) ? branch : next));
+			break;
+		case 0x02: //J
+			BATCH_LANES(BATCH_SET(pcs, (next & 0xF0000000) | (TARGET(instruction) << 2)));
+			break;
+		case 0x03: //JAL
+			BATCH_LANES(BATCH_SET(pcs, (next & 0xF0000000) | (TARGET(instruction) << 2)));
+			BATCH_LANES(BATCH_SET(b->REGS[31], next));
+			break;
+		case 0x08: //ADDI
+		case 0x09: //ADDIU
+			if (writes_rt) BATCH_LANES(BATCH_SET(rtw, rs[l] + simm));
+			break;
+		case 0x0A: //SLTI
+			if (writes_rt) BATCH_LANES(BATCH_SET(rtw, (uint32_t)((int32_t)rs[l] < (int32_t)simm)));
+			break;
+		case 0x0C: //ANDI
+			if (writes_rt) BATCH_LANES(BATCH_SET(rtw, rs[l] & imm));
+			break;
+		case 0x0D: //ORI
+			if (writes_rt) BATCH_LANES(BATCH_SET(rtw, rs[l] | imm));
+			break;
+		case 0x0E: //XORI
+			if (writes_rt) BATCH_LANES(BATCH_SET(rtw, rs[l] ^ imm));
+			break;
+		case 0x0F: //LUI
+			if (writes_rt) BATCH_LANES(BATCH_SET(rtw, imm << 16));
+			break;
+		case 0x10: //MFC0, MTC0, a lane's cycles and instructions both count its retired instructions
+		{
+			int index = cp0_index(instruction);
+			uint32_t *base = (index == CP0_CYCLES || index == CP0_INSTRUCTIONS) ? b->cp0_base[index] : NULL;
+			
+			if (RS(instruction) == 0x04) {
+				if (base != NULL) BATCH_LANES(BATCH_SET(base, b->count[l] - 1 - rt[l]));
+			}
+			else if (writes_rt && base != NULL) {
+				BATCH_LANES(BATCH_SET(rtw, b->count[l] - 1 - base[l]));
+			}
+			else if (writes_rt) {
+				BATCH_LANES(BATCH_SET(rtw, 0)); /*no pipeline, so no stalls, mispredicts or misses*/
+			}
+			break;
+		}
+		default: //loads and stores gather/scatter one lane at a time
+		{
+			for (l = 0; l < n; l++) {
+				if (!m[l]) {
+					continue;
+				}
+				address = rs[l] + simm;
+				shift = (address & 3) * 8;
+				switch(OPCODE(instruction))
+				{
+					case 0x20: //LB
+						word = batch_read_32(b, l, address & ~3);
+						if (writes_rt) rtw[l] = (uint32_t)(int32_t)(int8_t)(word >> shift);
+						break;
+					case 0x21: //LH
+						word = batch_read_32(b, l, address);
+						if (writes_rt) rtw[l] = (uint32_t)(int32_t)(int16_t)word;
+						break;
+					case 0x23: //LW
+						word = batch_read_32(b, l, address);
+						if (writes_rt) rtw[l] = word;
+						break;
+					case 0x28: //SB
+						word = batch_read_32(b, l, address & ~3);
+						word = (word & ~(0xFFu << shift)) | ((rt[l] & 0xFF) << shift);
+						batch_write_32(b, l, address & ~3, word);
+						break;
+					case 0x29: //SH
+						word = batch_read_32(b, l, address & ~3);
+						word = (word & ~(0xFFu << shift)) | ((rt[l] & 0xFF) << shift);
+						batch_write_32(b, l, address & ~3, word);
+						shift = ((address + 1) & 3) * 8;
+						word = batch_read_32(b, l, (address + 1) & ~3);
+						word = (word & ~(0xFFu << shift)) | (((rt[l] >> 8) & 0xFF) << shift);
+						batch_write_32(b, l, (address + 1) & ~3, word);
+						break;
+					case 0x2B: //SW
+						batch_write_32(b, l, address, rt[l]);
+						break;
+				}
+			}
+			break;
+		}
+	}
+}
+
+/***************************************************************/
+/* Run <lanes> copies of the program from the current architectural state */
+/* to completion, lane i starting with GPR <reg> = start + i * step          */
+/***************************************************************/
+void run_batch(uint32_t lanes, uint32_t reg, uint32_t start, uint32_t step) {
+	Batch_State b;
+	uint32_t l, r, pc, index, live, active, checksum;
+	uint64_t steps = 0, retired = 0;
+	clock_t begin;
+	double seconds;
+	
+	if (lanes == 0 || lanes > BATCH_MAX_LANES || reg >= MIPS_REGS) {
+		printf("Error: batch needs 1..%d lanes and a register 0..%d\n\n", BATCH_MAX_LANES, MIPS_REGS - 1);
+		return;
+	}
+	memset(&b, 0, sizeof(b));
+	b.lanes = lanes;
+	for (r = 0; r < MIPS_REGS; r++) {
+		b.REGS[r] = malloc(lanes * sizeof(uint32_t));
+		for (l = 0; l < lanes; l++) {
+			b.REGS[r][l] = CURRENT_STATE.REGS[r];
+		}
+	}
+	b.HI = malloc(lanes * sizeof(uint32_t));
+	b.LO = malloc(lanes * sizeof(uint32_t));
+	b.PC = malloc(lanes * sizeof(uint32_t));
+	b.HEAP = malloc(lanes * sizeof(uint32_t));
+	b.mask = malloc(lanes * sizeof(uint32_t));
+	b.count = calloc(lanes, sizeof(uint32_t));
+	b.done = calloc(lanes, sizeof(uint32_t));
+	for (r = 0; r < CP0_COUNTERS; r++) {
+		b.cp0_base[r] = calloc(lanes, sizeof(uint32_t));
+	}
+	b.pages = calloc(lanes, sizeof(Batch_Pages));
+	for (l = 0; l < lanes; l++) {
+		b.HI[l] = CURRENT_STATE.HI;
+		b.LO[l] = CURRENT_STATE.LO;
+		b.PC[l] = CURRENT_STATE.PC;
+		b.HEAP[l] = HEAP_END;
+		if (reg != 0) {
+			b.REGS[reg][l] = start + l * step;
+		}
+	}
+	
+	printf("Running %u lanes in lockstep...\n\n", lanes);
+	begin = clock();
+	live = lanes;
+	while (live > 0) {
+		/*issue the lowest PC so lanes that branched ahead wait for the others to reconverge*/
+		pc = 0xFFFFFFFF;
+		for (l = 0; l < lanes; l++) {
+			if (!b.done[l] && b.PC[l] < pc) {
+				pc = b.PC[l];
+			}
+		}
+		active = 0;
+		for (l = 0; l < lanes; l++) {
+			b.mask[l] = (!b.done[l] && b.PC[l] == pc) ? 0xFFFFFFFF : 0;
+			active += b.mask[l] & 1;
+		}
+		
+		index = (pc - MEM_TEXT_BEGIN) >> 2;
+		batch_execute(&b, pc, (index < TEXT_TABLE_SIZE && (pc & 3) == 0) ? TEXT_TABLE[index].IR : mem_read_32(pc));
+		for (r = 0; r < lanes; r++) {
+			b.REGS[0][r] = 0;
+		}
+		steps++;
+		retired += active;
+		
+		live = 0;
+		for (l = 0; l < lanes; l++) {
+			live += !b.done[l];
+		}
+	}
+	seconds = (double)(clock() - begin) / CLOCKS_PER_SEC;
+	output_flush();
+	
+	printf("-------------------------------------------------------------\n");
+	printf("[Lane]\t[R%u]\t\t[Instructions]\t[$v0]\t\t[Register checksum]\n", reg);
+	printf("-------------------------------------------------------------\n");
+	for (l = 0; l < lanes; l++) {
+		/*FNV-1a over the register file, HI and LO*/
+		checksum = 2166136261u;
+		for (r = 0; r < MIPS_REGS; r++) {
+			checksum = (checksum ^ b.REGS[r][l]) * 16777619u;
+		}
+		checksum = (checksum ^ b.HI[l]) * 16777619u;
+		checksum = (checksum ^ b.LO[l]) * 16777619u;
+		printf("%u\t0x%08x\t%u\t\t0x%08x\t0x%08x\n", l, start + l * step, b.count[l], b.REGS[2][l], checksum);
+	}
+	printf("-------------------------------------------------------------\n");
+	printf("%llu lane-instructions in %llu lockstep steps (%.1f lanes/step), %.3f s\n\n",
+		(unsigned long long)retired, (unsigned long long)steps, steps ? (double)retired / steps : 0.0, seconds);
+	
+	for (r = 0; r < MIPS_REGS; r++) {
+		free(b.REGS[r]);
+	}
+	for (l = 0; l < lanes; l++) {
+		for (r = 0; r < b.pages[l].size; r++) {
+			free(b.pages[l].data[r]);
+		}
+		free(b.pages[l].keys);
+		free(b.pages[l].data);
+	}
+	free(b.HI);
+	free(b.LO);
+	free(b.PC);
+	free(b.HEAP);
+	free(b.mask);
+	free(b.count);
+	free(b.done);
+	for (r = 0; r < CP0_COUNTERS; r++) {
+		free(b.cp0_base[r]);
+	}
+	free(b.pages);
 }
 
+#if MU_SLICE
 /***************************************************************/
-/* Execute one cycle                                                                                                              */
+/* Functional fast-forward: interpret instructions straight off the ISA   */
+/* until <limit> have retired, the pipeline stays empty throughout.       */
+/* Cycles follow a flat model (one per instruction plus the two-cycle     */
+/* flush of a taken branch) so guest CP0 reads still see them advance.   */
 /***************************************************************/
-void cycle() {                                                
-	handle_pipeline();
+void functional_run(uint32_t limit) {
+	CPU_State *s = &NEXT_STATE;
+	uint32_t instruction, index, pc;
+	Alu_Result r;
+	Inst_Deps d;
+	int cp0;
+	
+	while (RUN_FLAG && INSTRUCTION_COUNT < limit) {
+		pc = s->PC;
+		index = (pc - MEM_TEXT_BEGIN) >> 2;
+		instruction = (index < TEXT_TABLE_SIZE && (pc & 3) == 0) ? TEXT_TABLE[index].IR : mem_read_32(pc);
+		s->PC = pc + 4;
+		CYCLE_COUNT++;
+		r = alu_execute(instruction, pc, s->REGS[RS(instruction)], s->REGS[RT(instruction)], s->HI, s->LO);
+		
+		/*apply the result the way MEM and WB would*/
+		if (OPCODE(instruction) == 0x00 && FUNCT(instruction) == 0x0C) { //SYSCALL
+			MEM_WB.PC = pc; /*for the unknown syscall message*/
+			handle_syscall();
+		}
+		else if (OPCODE(instruction) == 0x10) { //MFC0, MTC0
+			cp0 = cp0_index(instruction);
+			if (RS(instruction) == 0x04) {
+				if (cp0 >= 0) {
+					CP0_BASE[cp0] = cp0_counter(cp0) - s->REGS[RT(instruction)];
+				}
+			}
+			else if (RT(instruction) != 0) {
+				s->REGS[RT(instruction)] = (cp0 >= 0) ? cp0_counter(cp0) - CP0_BASE[cp0] : 0;
+			}
+		}
+		else {
+			d = decode_deps(instruction);
+			if (d.dest == REG_HILO) {
+				s->HI = r.HI;
+				s->LO = r.LO;
+			}
+			else if (d.kind == INST_LOAD) {
+				s->REGS[d.dest] = mem_access(instruction, r.value, 0);
+			}
+			else if (d.kind == INST_ALU) {
+				s->REGS[d.dest] = r.value;
+			}
+			else if (OPCODE(instruction) >= 0x20) { //stores
+				mem_access(instruction, r.value, s->REGS[RT(instruction)]);
+			}
+		}
+		if (r.taken) {
+			s->PC = r.target;
+			CYCLE_COUNT += 2; /*IF and ID squashed*/
+			PROFILE(FLUSH_COUNT++);
+		}
+		INSTRUCTION_COUNT++;
+	}
 	CURRENT_STATE = NEXT_STATE;
-	CYCLE_COUNT++;
 }
 
 /***************************************************************/
-/* Simulate MIPS for n cycles                                                                                       */
+/* Hand a value read by the fast-forward to every waiting checkpoint           */
 /***************************************************************/
-void run(int num_cycles) {                                      
+void slice_record_input(int value) {
+	uint32_t i;
 	
-	if (RUN_FLAG == FALSE) {
-		printf("Simulation Stopped\n\n");
-		return;
+	for (i = 0; i < SLICE_HOLD_COUNT; i++) {
+		if (write(SLICE_HOLDS[i].input, &value, sizeof(value)) != sizeof(value)) {
+			printf("Error: Can't pass input to slice %u\n", SLICE_HOLDS[i].slice);
+		}
 	}
+}
 
-	printf("Running simulator for %d cycles...\n\n", num_cycles);
-	int i;
-	for (i = 0; i < num_cycles; i++) {
-		if (RUN_FLAG == FALSE) {
-			printf("Simulation Stopped.\n\n");
+/***************************************************************/
+/* Checkpoint process: wait for release, then time instructions                 */
+/* [begin, end) on the detailed pipeline and report through result        */
+/***************************************************************/
+void slice_child(uint32_t slice, uint32_t begin, uint32_t end, int input, int result) {
+	Slice_Result r;
+	uint32_t size = 0;
+	int value, measuring = FALSE;
+	
+	/*the fast-forward closes the pipe once it has retired the whole slice*/
+	SLICE_INPUT = NULL;
+	SLICE_INPUT_COUNT = SLICE_INPUT_NEXT = 0;
+	while (read(input, &value, sizeof(value)) == sizeof(value)) {
+		if (SLICE_INPUT_COUNT == size) {
+			size = size ? size * 2 : 64;
+			SLICE_INPUT = realloc(SLICE_INPUT, size * sizeof(int));
+		}
+		SLICE_INPUT[SLICE_INPUT_COUNT++] = value;
+	}
+	close(input);
+	
+	/*guest output was printed by the fast-forward*/
+	if (freopen("/dev/null", "w", stdout) == NULL) {
+		_exit(1);
+	}
+	SLICE_MODE = SLICE_DETAILED;
+	UNDO(undo_configure(0));
+	memset(&r, 0, sizeof(r));
+	r.pid = getpid();
+	r.slice = slice;
+	
+	while (TRUE) {
+		if (!measuring && INSTRUCTION_COUNT >= begin) {
+			/*warm-up done, the pipeline now holds what it would in a full run*/
+			measuring = TRUE;
+			r.cycles = CYCLE_COUNT;
+#if MU_PROFILE
+			r.stalls = STALL_COUNT;
+			r.flushes = FLUSH_COUNT;
+			r.loads = LOAD_COUNT;
+			r.stores = STORE_COUNT;
+			r.branches = BRANCH_COUNT;
+#endif
+		}
+		if (RUN_FLAG == FALSE || INSTRUCTION_COUNT >= end) {
 			break;
 		}
 		cycle();
 	}
+	if (measuring) {
+		r.instructions = INSTRUCTION_COUNT - begin;
+		r.cycles = CYCLE_COUNT - r.cycles;
+#if MU_PROFILE
+		r.stalls = STALL_COUNT - r.stalls;
+		r.flushes = FLUSH_COUNT - r.flushes;
+		r.loads = LOAD_COUNT - r.loads;
+		r.stores = STORE_COUNT - r.stores;
+		r.branches = BRANCH_COUNT - r.branches;
+#endif
+	}
+	else {
+		r.cycles = 0; /*program exited before the slice began*/
+	}
+	if (write(result, &r, sizeof(r)) != sizeof(r)) {
+		_exit(1);
+	}
+	_exit(0);
 }
 
 /***************************************************************/
-/* simulate to completion                                                                                               */
+/* Reap the slice that sent r and file its result by slice number           */
 /***************************************************************/
-void runAll() {                                                     
+void slice_collect(Slice_Result **results, uint32_t *size, const Slice_Result *r) {
+	uint32_t old = *size;
+	
+	waitpid(r->pid, NULL, 0);
+	if (r->slice >= old) {
+		*size = (r->slice + 1 > old * 2) ? r->slice + 1 : old * 2;
+		*results = realloc(*results, *size * sizeof(Slice_Result));
+		memset(&(*results)[old], 0, (*size - old) * sizeof(Slice_Result));
+	}
+	(*results)[r->slice] = *r;
+}
+
+/***************************************************************/
+/* Simulate to completion in slices of <length> instructions, timing each  */
+/* slice in its own process after <warmup> instructions of pipeline fill     */
+/***************************************************************/
+void run_slices(uint32_t length, uint32_t warmup) {
+	Slice_Result *results = NULL;
+	Slice_Result r, before;
+	Slice_Hold *hold;
+	uint32_t result_size = 0, holds_size = 0, next = 0, running = 0, limit, sliced = 0, i;
+	uint32_t base = INSTRUCTION_COUNT, first_cycle = CYCLE_COUNT;
+	uint64_t start, instructions = 0, cycles = 0, stalls = 0, flushes = 0;
+	int result_pipe[2], input_pipe[2], failed = FALSE;
+	pid_t pid;
+	long processors;
+	struct timespec begin, finish;
+	
 	if (RUN_FLAG == FALSE) {
 		printf("Simulation Stopped.\n\n");
 		return;
 	}
-
-	printf("Simulation Started...\n\n");
-	while (RUN_FLAG){
-		cycle();
+	if (length == 0) {
+		printf("Error: Slice length must be at least one instruction\n\n");
+		return;
 	}
-	printf("Simulation Finished.\n\n");
+	if (IF_ID.valid || ID_EX.valid || EX_MEM.valid || MEM_WB.valid) {
+		printf("Error: Slices start from an empty pipeline, reset first\n\n");
+		return;
+	}
+#if MU_CAPTURE
+	if (CAPTURE_FILE != NULL) {
+		printf("Error: Stop the capture before simulating in slices\n\n");
+		return;
+	}
+#endif
+#if MU_SWEEP
+	if (SWEEP_ACTIVE) {
+		printf("Error: Stop the sweep before simulating in slices\n\n");
+		return;
+	}
+#endif
+	processors = sysconf(_SC_NPROCESSORS_ONLN);
+	limit = (processors > 0) ? (uint32_t)processors : 1;
+	/*every slice whose warm-up has begun is a held process, keep that near limit*/
+	if (warmup >= (uint64_t)length * limit) {
+		printf("Error: Warm-up must be shorter than %u slice lengths (%llu instructions)\n\n",
+			limit, (unsigned long long)length * limit);
+		return;
+	}
+	if (pipe(result_pipe) != 0) {
+		printf("Error: Can't create the slice result pipe\n\n");
+		return;
+	}
+	memset(&before, 0, sizeof(before));
+#if MU_PROFILE
+	before.stalls = STALL_COUNT;
+	before.flushes = FLUSH_COUNT;
+	before.loads = LOAD_COUNT;
+	before.stores = STORE_COUNT;
+	before.branches = BRANCH_COUNT;
+#endif
+	
+	printf("Simulating slices of %u instructions (%u warm-up) on up to %u host processes...\n\n", length, warmup, limit);
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	SLICE_MODE = SLICE_FORWARD;
+	SLICE_HOLD_COUNT = 0;
+	while (TRUE) {
+		/*checkpoint every slice whose warm-up starts at this instruction*/
+		while (RUN_FLAG && !failed) {
+			start = (uint64_t)next * length;
+			start = (start > warmup) ? start - warmup : 0;
+			if (base + start != INSTRUCTION_COUNT) {
+				break;
+			}
+			if (pipe(input_pipe) != 0) {
+				printf("Error: Can't create the input pipe of slice %u\n", next);
+				failed = TRUE;
+				break;
+			}
+			output_flush();
+			fflush(stdout);
+			pid = fork();
+			if (pid == 0) {
+				close(result_pipe[0]);
+				close(input_pipe[1]);
+				for (i = 0; i < SLICE_HOLD_COUNT; i++) {
+					close(SLICE_HOLDS[i].input);
+				}
+				slice_child(next, base + next * length, base + (next + 1) * length, input_pipe[0], result_pipe[1]);
+			}
+			close(input_pipe[0]);
+			if (pid < 0) {
+				printf("Error: Can't fork slice %u\n", next);
+				close(input_pipe[1]);
+				failed = TRUE;
+				break;
+			}
+			if (SLICE_HOLD_COUNT == holds_size) {
+				holds_size = holds_size ? holds_size * 2 : 8;
+				SLICE_HOLDS = realloc(SLICE_HOLDS, holds_size * sizeof(Slice_Hold));
+			}
+			hold = &SLICE_HOLDS[SLICE_HOLD_COUNT++];
+			hold->pid = pid;
+			hold->slice = next;
+			hold->end = base + (next + 1) * length;
+			hold->input = input_pipe[1];
+			next++;
+		}
+		
+		/*release checkpoints the fast-forward has run past, at most one per host processor at a time*/
+		while (SLICE_HOLD_COUNT > 0 && (RUN_FLAG == FALSE || failed || SLICE_HOLDS[0].end <= INSTRUCTION_COUNT)) {
+			while (!failed && running >= limit) {
+				if (read(result_pipe[0], &r, sizeof(r)) != sizeof(r)) {
+					printf("Error: Lost the result of a running slice\n");
+					failed = TRUE;
+					break;
+				}
+				slice_collect(&results, &result_size, &r);
+				running--;
+			}
+			close(SLICE_HOLDS[0].input);
+			if (failed) {
+				kill(SLICE_HOLDS[0].pid, SIGKILL); /*never let more than limit slices run*/
+				waitpid(SLICE_HOLDS[0].pid, NULL, 0);
+			}
+			else {
+				running++;
+			}
+			SLICE_HOLD_COUNT--;
+			memmove(&SLICE_HOLDS[0], &SLICE_HOLDS[1], SLICE_HOLD_COUNT * sizeof(Slice_Hold));
+		}
+		if (RUN_FLAG == FALSE || failed) {
+			break;
+		}
+		
+		/*fast-forward to the next checkpoint or release, whichever comes first*/
+		start = (uint64_t)next * length;
+		start = base + ((start > warmup) ? start - warmup : 0);
+		if (SLICE_HOLD_COUNT > 0 && SLICE_HOLDS[0].end < start) {
+			start = SLICE_HOLDS[0].end;
+		}
+		functional_run(start < 0xFFFFFFFF ? (uint32_t)start : 0xFFFFFFFF);
+	}
+	output_flush();
+	SLICE_MODE = SLICE_OFF;
+	close(result_pipe[1]);
+	
+	/*every writer is gone once the last child exits, so this ends at EOF*/
+	while (read(result_pipe[0], &r, sizeof(r)) == sizeof(r)) {
+		slice_collect(&results, &result_size, &r);
+	}
+	close(result_pipe[0]);
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	
+	printf("-------------------------------------------------------------\n");
+#if MU_PROFILE
+	printf("[Slice]\t[Instructions]\t[Cycles]\t[CPI]\t[Stalls]\t[Flushes]\n");
+#else
+	printf("[Slice]\t[Instructions]\t[Cycles]\t[CPI]\n");
+#endif
+	printf("-------------------------------------------------------------\n");
+	for (i = 0; i < result_size; i++) {
+		r = results[i];
+		if (r.pid == 0 || r.instructions == 0) {
+			continue;
+		}
+#if MU_PROFILE
+		printf("%u\t%u\t\t%u\t\t%.3f\t%u\t\t%u\n", i, r.instructions, r.cycles, (double)r.cycles / r.instructions, r.stalls, r.flushes);
+		before.loads += r.loads;
+		before.stores += r.stores;
+		before.branches += r.branches;
+#else
+		printf("%u\t%u\t\t%u\t\t%.3f\n", i, r.instructions, r.cycles, (double)r.cycles / r.instructions);
+#endif
+		sliced++;
+		instructions += r.instructions;
+		cycles += r.cycles;
+		stalls += r.stalls;
+		flushes += r.flushes;
+	}
+	printf("-------------------------------------------------------------\n");
+	printf("Total\t%llu\t\t%llu\t\t%.3f", (unsigned long long)instructions, (unsigned long long)cycles,
+		instructions ? (double)cycles / instructions : 0.0);
+#if MU_PROFILE
+	printf("\t%llu\t\t%llu", (unsigned long long)stalls, (unsigned long long)flushes);
+	/*the fast-forward bumped the counters too, keep only the detailed slices' view*/
+	STALL_COUNT = before.stalls + stalls;
+	FLUSH_COUNT = before.flushes + flushes;
+	LOAD_COUNT = before.loads;
+	STORE_COUNT = before.stores;
+	BRANCH_COUNT = before.branches;
+#endif
+	printf("\n%u slices in %.3f s\n\n", sliced, (finish.tv_sec - begin.tv_sec) + (finish.tv_nsec - begin.tv_nsec) / 1e9);
+	
+	/*the fast-forward retired the instructions, the slices supply the cycles*/
+	CYCLE_COUNT = first_cycle + cycles;
+	UNDO(undo_clear());
+#if MU_BREAK
+	BREAK_HIT = FALSE;
+#endif
+	free(results);
 }
+#endif
 
 /***************************************************************/ 
 /* Dump a word-aligned region of memory to the terminal                              */
@@ -147,6 +1980,13 @@ void rdump() {
 	printf("[HI]\t: 0x%08x\n", CURRENT_STATE.HI);
 	printf("[LO]\t: 0x%08x\n", CURRENT_STATE.LO);
 	printf("-------------------------------------\n");
+#if MU_PROFILE
+	printf("# Stall Cycles\t\t: %u\n", STALL_COUNT);
+	printf("# Pipeline Flushes\t: %u\n", FLUSH_COUNT);
+	printf("# Loads/Stores\t\t: %u/%u\n", LOAD_COUNT, STORE_COUNT);
+	printf("# Branches/Jumps\t: %u\n", BRANCH_COUNT);
+	printf("-------------------------------------\n");
+#endif
 }
 
 /***************************************************************/
@@ -154,11 +1994,13 @@ void rdump() {
 /***************************************************************/
 void handle_command() {                         
 	char buffer[20];
+	char path[256];
 	uint32_t start, stop, cycles;
 	uint32_t register_no;
 	int register_value;
 	int hi_reg_value, lo_reg_value;
 
+	output_flush();
 	printf("MU-MIPS SIM:> ");
 
 	if (scanf("%s", buffer) == EOF){
@@ -170,7 +2012,28 @@ void handle_command() {
 		case 's':
 			if (buffer[1] == 'h' || buffer[1] == 'H'){
 				show_pipeline();
-			}else {
+			}
+#if MU_SWEEP
+			else if (buffer[1] == 'w' || buffer[1] == 'W'){
+				if (scanf("%255s", path) != 1) {
+					break;
+				}
+				if (strcmp(path, "off") == 0) {
+					sweep_finish();
+				}else {
+					sweep_start(path);
+				}
+			}
+#endif
+#if MU_SLICE
+			else if (buffer[1] == 'l' || buffer[1] == 'L'){
+				if (scanf("%u %u", &cycles, &stop) != 2) {
+					break;
+				}
+				run_slices(cycles, stop);
+			}
+#endif
+			else {
 				runAll(); 
 			}
 			break;
@@ -194,9 +2057,19 @@ void handle_command() {
 		case 'r':
 			if (buffer[1] == 'd' || buffer[1] == 'D'){
 				rdump();
+			}else if((buffer[1] == 'e' || buffer[1] == 'E') && (buffer[2] == 'p' || buffer[2] == 'P')){
+				if (scanf("%255s", path) != 1) {
+					break;
+				}
+				replay_trace(path);
 			}else if(buffer[1] == 'e' || buffer[1] == 'E'){
 				reset();
 			}
+#if MU_UNDO
+			else if(buffer[1] == 's' || buffer[1] == 'S'){
+				undo_back(1);
+			}
+#endif
 			else {
 				if (scanf("%d", &cycles) != 1) {
 					break;
@@ -211,6 +2084,7 @@ void handle_command() {
 			}
 			CURRENT_STATE.REGS[register_no] = register_value;
 			NEXT_STATE.REGS[register_no] = register_value;
+			UNDO(undo_clear());
 			break;
 		case 'H':
 		case 'h':
@@ -219,6 +2093,7 @@ void handle_command() {
 			}
 			CURRENT_STATE.HI = hi_reg_value; 
 			NEXT_STATE.HI = hi_reg_value; 
+			UNDO(undo_clear());
 			break;
 		case 'L':
 		case 'l':
@@ -227,11 +2102,89 @@ void handle_command() {
 			}
 			CURRENT_STATE.LO = lo_reg_value;
 			NEXT_STATE.LO = lo_reg_value;
+			UNDO(undo_clear());
 			break;
 		case 'P':
 		case 'p':
 			print_program(); 
 			break;
+		case 'B':
+		case 'b':
+			if (buffer[1] == 'a' && buffer[2] == 't'){
+				if (scanf("%u %u %i %i", &cycles, &register_no, &hi_reg_value, &lo_reg_value) != 4) {
+					break;
+				}
+				run_batch(cycles, register_no, hi_reg_value, lo_reg_value);
+				break;
+			}
+#if MU_BREAK
+			if (buffer[1] == 'r' || buffer[1] == 'R'){
+				if (scanf("%x", &start) != 1) {
+					break;
+				}
+				breakpoint_add(start, FALSE, FALSE, 0, 0);
+				break;
+			}
+#endif
+#if MU_UNDO
+			if (scanf("%u", &cycles) != 1) {
+				break;
+			}
+			undo_back(cycles);
+#else
+			printf("Invalid Command.\n");
+#endif
+			break;
+		case 'C':
+		case 'c':
+#if MU_CAPTURE
+			if (buffer[1] == 'a' || buffer[1] == 'A'){
+				if (scanf("%255s", path) != 1) {
+					break;
+				}
+				if (strcmp(path, "off") == 0) {
+					capture_close();
+				}else {
+					capture_open(path);
+				}
+				break;
+			}
+#endif
+#if MU_BREAK
+			if (scanf("%x %u %i", &start, &register_no, &register_value) != 3) {
+				break;
+			}
+			breakpoint_add(start, FALSE, TRUE, register_no, register_value);
+#else
+			printf("Invalid Command.\n");
+#endif
+			break;
+#if MU_BREAK
+		case 'W':
+		case 'w':
+			if (scanf("%x", &start) != 1) {
+				break;
+			}
+			breakpoint_add(start, TRUE, FALSE, 0, 0);
+			break;
+		case 'D':
+		case 'd':
+			if (scanf("%x", &start) != 1) {
+				break;
+			}
+			breakpoint_delete(start);
+			break;
+#endif
+#if MU_UNDO
+		case 'U':
+		case 'u':
+			if (scanf("%u", &cycles) != 1) {
+				break;
+			}
+			undo_configure(cycles);
+			printf("Undo log holds %u cycles.\n\n", UNDO_WINDOW);
+			break;
+#endif
 		default:
 			printf("Invalid Command.\n");
 			break;
@@ -243,6 +2196,19 @@ void handle_command() {
 /***************************************************************/
 void reset() {   
 	int i;
+	
+#if MU_CAPTURE
+	if (CAPTURE_FILE != NULL) {
+		printf("Reset ends the trace capture.\n");
+		capture_close(); /*a trace covers one run, the counts below restart*/
+	}
+#endif
+#if MU_SWEEP
+	if (SWEEP_ACTIVE) {
+		printf("Reset ends the cache sweep.\n");
+		sweep_finish(); /*histograms describe one run*/
+	}
+#endif
 	/*reset registers*/
 	for (i = 0; i < MIPS_REGS; i++){
 		CURRENT_STATE.REGS[i] = 0;
@@ -250,60 +2216,354 @@ void reset() {
 	CURRENT_STATE.HI = 0;
 	CURRENT_STATE.LO = 0;
 	
+	/*fresh zero pages are far cheaper than clearing gigabytes of regions in place*/
+	for (i = 0; i < NUM_MEM_REGION; i++) {
+		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
+		free(MEM_REGIONS[i].mem);
+		MEM_REGIONS[i].mem = calloc(region_size, 1);
+	}
+	
+	/*load program*/
+	load_program();
+	
+	/*empty the pipeline*/
+	memset(&IF_ID, 0, sizeof(IF_ID));
+	memset(&ID_EX, 0, sizeof(ID_EX));
+	memset(&EX_MEM, 0, sizeof(EX_MEM));
+	memset(&MEM_WB, 0, sizeof(MEM_WB));
+	output_flush();
+	
+	/*reset PC*/
+	INSTRUCTION_COUNT = 0;
+	CYCLE_COUNT = 0;
+	PROFILE(STALL_COUNT = FLUSH_COUNT = 0);
+	PROFILE(LOAD_COUNT = STORE_COUNT = BRANCH_COUNT = 0);
+	HEAP_END = MEM_HEAP_BEGIN;
+	memset(CP0_BASE, 0, sizeof(CP0_BASE));
+	CURRENT_STATE.PC =  MEM_TEXT_BEGIN;
+	NEXT_STATE = CURRENT_STATE;
+	RUN_FLAG = TRUE;
+	UNDO(undo_clear());
+}
+
+/***************************************************************/
+/* Allocate and set memory to zero                                                                            */
+/***************************************************************/
+void init_memory() {                                           
+	int i;
 	for (i = 0; i < NUM_MEM_REGION; i++) {
 		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		memset(MEM_REGIONS[i].mem, 0, region_size);
+		MEM_REGIONS[i].mem = calloc(region_size, 1);
+		if (MEM_REGIONS[i].mem == NULL) {
+			printf("Error: Can't allocate memory region 0x%08x\n", MEM_REGIONS[i].begin);
+			exit(-1);
+		}
+	}
+}
+
+/**************************************************************/
+/* load program into memory                                                                                      */
+/**************************************************************/
+void load_program() {                   
+	FILE * fp;
+	int i, word;
+	uint32_t address;
+
+	/* Open program file. */
+	fp = fopen(prog_file, "r");
+	if (fp == NULL) {
+		printf("Error: Can't open program file %s\n", prog_file);
+		exit(-1);
+	}
+
+	/* Read in the program. */
+
+	i = 0;
+	while( fscanf(fp, "%x\n", &word) != EOF ) {
+		address = MEM_TEXT_BEGIN + i;
+		mem_write_32(address, word);
+		printf("writing 0x%08x into address 0x%08x (%d)\n", word, address, address);
+		i += 4;
+	}
+	PROGRAM_SIZE = i/4;
+	printf("Program loaded into memory.\n%d words written into memory.\n\n", PROGRAM_SIZE);
+	fclose(fp);
+	predecode_program();
+}
+
+/**************************************************************/
+/* build the predecoded table IF fetches the program from                         */
+/**************************************************************/
+void predecode_program() {
+	uint32_t i;
+	
+	free(TEXT_TABLE);
+	TEXT_TABLE_SIZE = 0;
+	TEXT_TABLE = calloc(PROGRAM_SIZE, sizeof(Predecoded));
+	if (TEXT_TABLE == NULL) {
+		return; /*IF falls back to mem_read_32*/
+	}
+	for (i = 0; i < PROGRAM_SIZE; i++) {
+		TEXT_TABLE[i].IR = mem_read_32(MEM_TEXT_BEGIN + (i * 4));
+	}
+	TEXT_TABLE_SIZE = PROGRAM_SIZE;
+#if MU_BREAK
+	breakpoint_sync();
+#endif
+}
+
+/************************************************************/
+/* DIV/DIVU: HI = remainder, LO = quotient, never traps on the host     */ 
+/* Divide by zero leaves 0 in both, 0x80000000 / -1 wraps like MIPS    */ 
+/************************************************************/
+void alu_divide(uint32_t a, uint32_t b, int is_signed, uint32_t *hi, uint32_t *lo)
+{
+	if (b == 0) {
+		*hi = 0;
+		*lo = 0;
+	}
+	else if (is_signed) {
+		/*64-bit so INT32_MIN / -1 does not overflow*/
+		*hi = (uint32_t)((int64_t)(int32_t)a % (int64_t)(int32_t)b);
+		*lo = (uint32_t)((int64_t)(int32_t)a / (int64_t)(int32_t)b);
+	}
+	else {
+		*hi = a % b;
+		*lo = a / b;
+	}
+}
+
+/************************************************************/
+/* decode the register dependencies of an instruction                                         */ 
+/************************************************************/
+Inst_Deps decode_deps(uint32_t instruction)
+{
+	Inst_Deps d = { 0, 0, 0, INST_NONE };
+	
+	switch(OPCODE(instruction))
+	{
+		case 0x00: //special
+		{
+			switch(FUNCT(instruction))
+			{
+				case 0x00: //SLL
+				case 0x02: //SRL
+				case 0x03: //SRA
+					d.src1 = RT(instruction);
+					d.dest = RD(instruction);
+					d.kind = INST_ALU;
+					break;
+				case 0x08: //JR
+					d.src1 = RS(instruction);
+					break;
+				case 0x09: //JALR
+					d.src1 = RS(instruction);
+					d.dest = RD(instruction);
+					d.kind = INST_ALU;
+					break;
+				case 0x0C: //SYSCALL reads $v0/$a0 and may write $v0 in WB
+					d.src1 = 2;
+					d.src2 = 4;
+					d.dest = 2;
+					d.kind = INST_LATE;
+					break;
+				case 0x10: //MFHI
+				case 0x12: //MFLO
+					d.src1 = REG_HILO;
+					d.dest = RD(instruction);
+					d.kind = INST_ALU;
+					break;
+				case 0x11: //MTHI
+				case 0x13: //MTLO
+					d.src1 = RS(instruction);
+					d.dest = REG_HILO;
+					d.kind = INST_LATE;
+					break;
+				case 0x18: //MULT
+				case 0x19: //MULTU
+				case 0x1A: //DIV
+				case 0x1B: //DIVU
+					d.src1 = RS(instruction);
+					d.src2 = RT(instruction);
+					d.dest = REG_HILO;
+					d.kind = INST_LATE;
+					break;
+				default: //ADD, ADDU, SUB, SUBU, AND, OR, XOR, NOR, SLT
+					d.src1 = RS(instruction);
+					d.src2 = RT(instruction);
+					d.dest = RD(instruction);
+					d.kind = INST_ALU;
+					break;
+			}
+			break;
+		}
+		case 0x01: //BLTZ, BGEZ
+		case 0x06: //BLEZ
+		case 0x07: //BGTZ
+			d.src1 = RS(instruction);
+			break;
+		case 0x04: //BEQ
+		case 0x05: //BNE
+			d.src1 = RS(instruction);
+			d.src2 = RT(instruction);
+			break;
+		case 0x02: //J
+			break;
+		case 0x03: //JAL
+			d.dest = 31;
+			d.kind = INST_ALU;
+			break;
+		case 0x0F: //LUI
+			d.dest = RT(instruction);
+			d.kind = INST_ALU;
+			break;
+		case 0x10: //MFC0, MTC0 both access CP0 in WB
+			if (RS(instruction) == 0x04) {
+				d.src1 = RT(instruction);
+			}
+			else {
+				d.dest = RT(instruction);
+				d.kind = INST_LATE;
+			}
+			break;
+		case 0x20: //LB
+		case 0x21: //LH
+		case 0x23: //LW
+			d.src1 = RS(instruction);
+			d.dest = RT(instruction);
+			d.kind = INST_LOAD;
+			break;
+		case 0x28: //SB
+		case 0x29: //SH
+		case 0x2B: //SW
+			d.src1 = RS(instruction);
+			d.src2 = RT(instruction);
+			break;
+		default: //ADDI, ADDIU, SLTI, ANDI, ORI, XORI
+			d.src1 = RS(instruction);
+			d.dest = RT(instruction);
+			d.kind = INST_ALU;
+			break;
 	}
 	
-	/*load program*/
-	load_program();
-	
-	/*reset PC*/
-	INSTRUCTION_COUNT = 0;
-	CURRENT_STATE.PC =  MEM_TEXT_BEGIN;
-	NEXT_STATE = CURRENT_STATE;
-	RUN_FLAG = TRUE;
+	/*writes to $0 are discarded, so they never create a dependency*/
+	if (d.dest == 0) {
+		d.kind = INST_NONE;
+	}
+	return d;
 }
 
-/***************************************************************/
-/* Allocate and set memory to zero                                                                            */
-/***************************************************************/
-void init_memory() {                                           
-	int i;
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		MEM_REGIONS[i].mem = malloc(region_size);
-		memset(MEM_REGIONS[i].mem, 0, region_size);
+/************************************************************/
+/* does consumer read the register producer writes?                                        */ 
+/************************************************************/
+int depends_on(Inst_Deps consumer, Inst_Deps producer)
+{
+	if (producer.kind == INST_NONE) {
+		return FALSE;
 	}
+	return (consumer.src1 == producer.dest) || (consumer.src2 == producer.dest);
 }
 
-/**************************************************************/
-/* load program into memory                                                                                      */
-/**************************************************************/
-void load_program() {                   
-	FILE * fp;
-	int i, word;
-	uint32_t address;
-
-	/* Open program file. */
-	fp = fopen(prog_file, "r");
-	if (fp == NULL) {
-		printf("Error: Can't open program file %s\n", prog_file);
-		exit(-1);
+/************************************************************/
+/* counter selected by an MFC0/MTC0, -1 for registers not implemented */ 
+/************************************************************/
+int cp0_index(uint32_t instruction)
+{
+	uint32_t sel = instruction & 0x7;
+	
+	if (RD(instruction) == CP0_COUNT && sel == 0) {
+		return CP0_CYCLES;
 	}
+	if (RD(instruction) == CP0_PERF && sel < CP0_COUNTERS) {
+		return sel;
+	}
+	return -1;
+}
 
-	/* Read in the program. */
+/************************************************************/
+/* host-side count behind a CP0 counter, sampled in WB                      */ 
+/************************************************************/
+uint32_t cp0_counter(int index)
+{
+	switch(index)
+	{
+		case CP0_CYCLES:
+			return CYCLE_COUNT;
+		case CP0_INSTRUCTIONS:
+			return INSTRUCTION_COUNT;
+#if MU_PROFILE
+		case CP0_STALLS:
+			return STALL_COUNT;
+		case CP0_MISPREDICTS:
+			return FLUSH_COUNT; /*predict not-taken: every flush is a mispredict*/
+#endif
+		default:
+			return 0;
+	}
+}
 
-	i = 0;
-	while( fscanf(fp, "%x\n", &word) != EOF ) {
-		address = MEM_TEXT_BEGIN + i;
-		mem_write_32(address, word);
-		printf("writing 0x%08x into address 0x%08x (%d)\n", word, address, address);
-		i += 4;
+/************************************************************/
+/* execute a SYSCALL (SPIM conventions: code in $v0, argument in $a0)     */ 
+/************************************************************/
+void handle_syscall()
+{
+	char text[16];
+	uint32_t address;
+	uint8_t c;
+	int value;
+	
+	switch(NEXT_STATE.REGS[2])
+	{
+		case 1: //print int
+			output_write(text, snprintf(text, sizeof(text), "%d", (int32_t)NEXT_STATE.REGS[4]));
+			break;
+		case 4: //print string
+			for (address = NEXT_STATE.REGS[4]; (c = mem_read_8(address)) != 0; address++) {
+				output_write((char *)&c, 1);
+			}
+			break;
+		case 5: //read int
+#if MU_UNDO
+			if (UNDO_REPLAYING) {
+				NEXT_STATE.REGS[2] = UNDO_REPLAY_INPUT[CYCLE_COUNT - UNDO_REPLAY_BASE];
+				undo_record_input(NEXT_STATE.REGS[2]); /*the frame was reopened, keep it for the next rewind*/
+				break;
+			}
+#endif
+#if MU_SLICE
+			if (SLICE_MODE == SLICE_DETAILED) {
+				NEXT_STATE.REGS[2] = (SLICE_INPUT_NEXT < SLICE_INPUT_COUNT) ? SLICE_INPUT[SLICE_INPUT_NEXT++] : 0;
+				break;
+			}
+#endif
+			output_flush();
+			if (scanf("%d", &value) != 1) {
+				value = 0;
+			}
+			NEXT_STATE.REGS[2] = value;
+			UNDO(undo_record_input(value));
+#if MU_SLICE
+			if (SLICE_MODE == SLICE_FORWARD) {
+				slice_record_input(value);
+			}
+#endif
+			break;
+		case 9: //sbrk
+			NEXT_STATE.REGS[2] = HEAP_END;
+			HEAP_END += (NEXT_STATE.REGS[4] + 3) & ~3;
+			break;
+		case 10: //exit
+			output_flush();
+			RUN_FLAG = FALSE;
+#if MU_SWEEP
+			sweep_finish();
+#endif
+			break;
+		default:
+			output_flush();
+			printf("Unknown syscall %u at 0x%08x\n", NEXT_STATE.REGS[2], MEM_WB.PC);
+			break;
 	}
-	PROGRAM_SIZE = i/4;
-	printf("Program loaded into memory.\n%d words written into memory.\n\n", PROGRAM_SIZE);
-	fclose(fp);
 }
 
 /************************************************************/
@@ -311,10 +2571,15 @@ void load_program() {
 /************************************************************/
 void handle_pipeline()
 {
-	/*INSTRUCTION_COUNT should be incremented when instruction is done*/
-	/*Since we do not have branch/jump instructions, INSTRUCTION_COUNT should be incremented in WB stage */
+	/*stages run back to front so each one consumes the pipeline register its successor has already drained*/
+	/*INSTRUCTION_COUNT is incremented in the WB stage, squashed instructions never reach it*/
+	PIPE_STALL = FALSE;
+	PIPE_FLUSH = FALSE;
 	
 	WB();
+	if (RUN_FLAG == FALSE) {
+		return; /*exit syscall retired, younger instructions must not touch memory*/
+	}
 	MEM();
 	EX();
 	ID();
@@ -327,7 +2592,110 @@ void handle_pipeline()
 /************************************************************/
 void WB()
 {
-	/*IMPLEMENT THIS*/
+	uint32_t instruction = MEM_WB.IR;
+	Inst_Deps d;
+	int index;
+	
+	if (!MEM_WB.valid) {
+		return; /*bubble, a real nop (IR 0) still retires*/
+	}
+	
+	if (OPCODE(instruction) == 0x00 && FUNCT(instruction) == 0x0C) {
+		handle_syscall();
+	}
+	else if (OPCODE(instruction) == 0x10) { //MFC0, MTC0
+		index = cp0_index(instruction);
+		if (RS(instruction) == 0x04) {
+			if (index >= 0) {
+				CP0_BASE[index] = cp0_counter(index) - MEM_WB.B;
+			}
+		}
+		else if (RT(instruction) != 0) {
+			NEXT_STATE.REGS[RT(instruction)] = (index >= 0) ? cp0_counter(index) - CP0_BASE[index] : 0;
+		}
+	}
+	else {
+		d = decode_deps(instruction);
+		if (d.dest == REG_HILO) {
+			switch(FUNCT(instruction))
+			{
+				case 0x11: //MTHI
+					NEXT_STATE.HI = MEM_WB.HI;
+					break;
+				case 0x13: //MTLO
+					NEXT_STATE.LO = MEM_WB.LO;
+					break;
+				default: //MULT, MULTU, DIV, DIVU
+					NEXT_STATE.HI = MEM_WB.HI;
+					NEXT_STATE.LO = MEM_WB.LO;
+					break;
+			}
+		}
+		else if (d.kind == INST_LOAD) {
+			NEXT_STATE.REGS[d.dest] = MEM_WB.LMD;
+		}
+		else if (d.kind == INST_ALU) {
+			NEXT_STATE.REGS[d.dest] = MEM_WB.ALUOutput;
+		}
+#if MU_PROFILE
+		switch(OPCODE(instruction))
+		{
+			case 0x20: case 0x21: case 0x23: //loads
+				LOAD_COUNT++;
+				break;
+			case 0x28: case 0x29: case 0x2B: //stores
+				STORE_COUNT++;
+				break;
+			case 0x01: case 0x02: case 0x03: case 0x04: case 0x05: case 0x06: case 0x07: //branches, jumps
+				BRANCH_COUNT++;
+				break;
+			case 0x00:
+				if (FUNCT(instruction) == 0x08 || FUNCT(instruction) == 0x09) { //JR, JALR
+					BRANCH_COUNT++;
+				}
+				break;
+		}
+#endif
+	}
+	INSTRUCTION_COUNT++;
+#if MU_CAPTURE
+	if (CAPTURE_FILE != NULL) {
+		capture_retire();
+		if (RUN_FLAG == FALSE) {
+			capture_close();
+		}
+	}
+#endif
+}
+
+/************************************************************/
+/* perform a load or store, returning the loaded value (0 for stores) */
+/************************************************************/
+uint32_t mem_access(uint32_t instruction, uint32_t address, uint32_t value)
+{
+	uint32_t word;
+	
+	switch(OPCODE(instruction))
+	{
+		case 0x20: //LB
+			return (uint32_t)(int32_t)(int8_t)mem_read_8(address);
+		case 0x21: //LH
+			word = mem_read_8(address) | (mem_read_8(address + 1) << 8);
+			return (uint32_t)(int32_t)(int16_t)word;
+		case 0x23: //LW
+			return mem_read_32(address);
+		case 0x28: //SB
+			mem_write_8(address, value & 0xFF);
+			break;
+		case 0x29: //SH
+			mem_write_8(address, value & 0xFF);
+			mem_write_8(address + 1, (value >> 8) & 0xFF);
+			break;
+		case 0x2B: //SW
+			mem_write_32(address, value);
+			break;
+	}
+	return 0;
 }
 
 //memory accessed
@@ -336,7 +2704,188 @@ void WB()
 /************************************************************/
 void MEM()
 {
-	/*IMPLEMENT THIS*/
+	uint32_t address = EX_MEM.ALUOutput;
+	
+	MEM_WB = EX_MEM;
+	
+#if MU_BREAK
+	if (EX_MEM.flags & PREDECODED_BREAK_LATE) {
+		breakpoint_check(EX_MEM.PC, TRUE);
+	}
+	if (WATCH_PAGES[address >> WATCH_PAGE_BITS]) {
+		switch(OPCODE(EX_MEM.IR))
+		{
+			case 0x20: watchpoint_check(address, 1, FALSE); break; //LB
+			case 0x21: watchpoint_check(address, 2, FALSE); break; //LH
+			case 0x23: watchpoint_check(address, 4, FALSE); break; //LW
+			case 0x28: watchpoint_check(address, 1, TRUE); break; //SB
+			case 0x29: watchpoint_check(address, 2, TRUE); break; //SH
+			case 0x2B: watchpoint_check(address, 4, TRUE); break; //SW
+		}
+	}
+#endif
+#if MU_SWEEP
+	if (SWEEP_ACTIVE && OPCODE(EX_MEM.IR) >= 0x20) { //loads and stores
+		sweep_access(&SWEEP_STREAMS[SWEEP_DATA], address);
+	}
+#endif
+	
+	if (OPCODE(EX_MEM.IR) >= 0x20) { //loads and stores
+		MEM_WB.LMD = mem_access(EX_MEM.IR, address, EX_MEM.B);
+	}
+}
+
+/************************************************************/
+/* evaluate an instruction's ALU, branch and HI/LO work on operands a/b */
+/* shared by EX and the functional fast-forward so the two cannot drift  */
+/************************************************************/
+Alu_Result alu_execute(uint32_t instruction, uint32_t pc, uint32_t a, uint32_t b, uint32_t hi, uint32_t lo)
+{
+	Alu_Result r = { 0, hi, lo, 0, FALSE }; /*HI/LO pass through, unimplemented instructions produce 0*/
+	uint64_t product;
+	
+	switch(OPCODE(instruction))
+	{
+		case 0x00: //special
+		{
+			switch(FUNCT(instruction))
+			{
+				case 0x00: //SLL
+					r.value = b << SA(instruction);
+					break;
+				case 0x02: //SRL
+					r.value = b >> SA(instruction);
+					break;
+				case 0x03: //SRA
+					r.value = (uint32_t)((int32_t)b >> SA(instruction));
+					break;
+				case 0x08: //JR
+					r.target = a;
+					r.taken = TRUE;
+					break;
+				case 0x09: //JALR
+					r.value = pc + 4;
+					r.target = a;
+					r.taken = TRUE;
+					break;
+				case 0x10: //MFHI
+					r.value = hi;
+					break;
+				case 0x12: //MFLO
+					r.value = lo;
+					break;
+				case 0x11: //MTHI
+					r.HI = a;
+					break;
+				case 0x13: //MTLO
+					r.LO = a;
+					break;
+				case 0x18: //MULT
+					product = (uint64_t)((int64_t)(int32_t)a * (int64_t)(int32_t)b);
+					r.HI = product >> 32;
+					r.LO = product & 0xFFFFFFFF;
+					break;
+				case 0x19: //MULTU
+					product = (uint64_t)a * (uint64_t)b;
+					r.HI = product >> 32;
+					r.LO = product & 0xFFFFFFFF;
+					break;
+				case 0x1A: //DIV
+					alu_divide(a, b, TRUE, &r.HI, &r.LO);
+					break;
+				case 0x1B: //DIVU
+					alu_divide(a, b, FALSE, &r.HI, &r.LO);
+					break;
+				case 0x20: //ADD
+				case 0x21: //ADDU
+					r.value = a + b;
+					break;
+				case 0x22: //SUB
+				case 0x23: //SUBU
+					r.value = a - b;
+					break;
+				case 0x24: //AND
+					r.value = a & b;
+					break;
+				case 0x25: //OR
+					r.value = a | b;
+					break;
+				case 0x26: //XOR
+					r.value = a ^ b;
+					break;
+				case 0x27: //NOR
+					r.value = ~(a | b);
+					break;
+				case 0x2A: //SLT
+					r.value = ((int32_t)a < (int32_t)b) ? 1 : 0;
+					break;
+			}
+			break;
+		}
+		case 0x01: //BLTZ, BGEZ
+			if (RT(instruction) == 0x01) {
+				r.taken = ((int32_t)a >= 0);
+			}
+			else {
+				r.taken = ((int32_t)a < 0);
+			}
+			r.target = pc + 4 + (SIMM(instruction) << 2);
+			break;
+		case 0x04: //BEQ
+			r.taken = (a == b);
+			r.target = pc + 4 + (SIMM(instruction) << 2);
+			break;
+		case 0x05: //BNE
+			r.taken = (a != b);
+			r.target = pc + 4 + (SIMM(instruction) << 2);
+			break;
+		case 0x06: //BLEZ
+			r.taken = ((int32_t)a <= 0);
+			r.target = pc + 4 + (SIMM(instruction) << 2);
+			break;
+		case 0x07: //BGTZ
+			r.taken = ((int32_t)a > 0);
+			r.target = pc + 4 + (SIMM(instruction) << 2);
+			break;
+		case 0x02: //J
+			r.target = ((pc + 4) & 0xF0000000) | (TARGET(instruction) << 2);
+			r.taken = TRUE;
+			break;
+		case 0x03: //JAL
+			r.value = pc + 4;
+			r.target = ((pc + 4) & 0xF0000000) | (TARGET(instruction) << 2);
+			r.taken = TRUE;
+			break;
+		case 0x08: //ADDI
+		case 0x09: //ADDIU
+			r.value = a + SIMM(instruction);
+			break;
+		case 0x0A: //SLTI
+			r.value = ((int32_t)a < (int32_t)SIMM(instruction)) ? 1 : 0;
+			break;
+		case 0x0C: //ANDI
+			r.value = a & IMM(instruction);
+			break;
+		case 0x0D: //ORI
+			r.value = a | IMM(instruction);
+			break;
+		case 0x0E: //XORI
+			r.value = a ^ IMM(instruction);
+			break;
+		case 0x0F: //LUI
+			r.value = IMM(instruction) << 16;
+			break;
+		case 0x20: //LB
+		case 0x21: //LH
+		case 0x23: //LW
+		case 0x28: //SB
+		case 0x29: //SH
+		case 0x2B: //SW
+			r.value = a + SIMM(instruction); //effective address
+			break;
+	}
+	
+	return r;
 }
 
 //instruction executed
@@ -345,7 +2894,31 @@ void MEM()
 /************************************************************/
 void EX()
 {
-	/*IMPLEMENT THIS*/
+	uint32_t instruction = ID_EX.IR;
+	uint32_t a = ID_EX.A;
+	uint32_t b = ID_EX.B;
+	Alu_Result r;
+	
+#if MU_FORWARDING
+	a = forward_operand(RS(instruction));
+	b = forward_operand(RT(instruction));
+#endif
+	EX_MEM = ID_EX;
+	EX_MEM.A = a;
+	EX_MEM.B = b;
+	
+	r = alu_execute(instruction, ID_EX.PC, a, b, NEXT_STATE.HI, NEXT_STATE.LO);
+	EX_MEM.ALUOutput = r.value;
+	EX_MEM.HI = r.HI;
+	EX_MEM.LO = r.LO;
+	
+	/*branches are predicted not taken, a taken branch squashes the instruction in ID and redirects fetch*/
+	if (r.taken) {
+		NEXT_STATE.PC = r.target;
+		PIPE_FLUSH = TRUE;
+		EX_MEM.taken = TRUE;
+		PROFILE(FLUSH_COUNT++);
+	}
 }
 
 //This is where the instruction is actually determined by the bit fields
@@ -354,18 +2927,90 @@ void EX()
 /************************************************************/
 void ID()
 {
-	/*IMPLEMENT THIS*/
+	uint32_t instruction = IF_ID.IR;
+	Inst_Deps d, ex;
+	
+	if (PIPE_FLUSH) {
+		memset(&ID_EX, 0, sizeof(ID_EX));
+		return;
+	}
+	
+	/*EX_MEM and MEM_WB hold the two older instructions that have not written back yet*/
+	d = decode_deps(instruction);
+	ex = decode_deps(EX_MEM.IR);
+#if MU_FORWARDING
+	/*ALU results forward from MEM/WB into EX next cycle, everything older has written back by then*/
+	if (depends_on(d, ex) && ex.kind != INST_ALU) {
+#else
+	if (depends_on(d, ex) || depends_on(d, decode_deps(MEM_WB.IR))) {
+#endif
+		PIPE_STALL = TRUE;
+		PROFILE(STALL_COUNT++);
+		memset(&ID_EX, 0, sizeof(ID_EX));
+		return;
+	}
+	
+	/*registers are written in the first half of the cycle (WB ran already) and read in the second*/
+	ID_EX = IF_ID;
+	ID_EX.A = NEXT_STATE.REGS[RS(instruction)];
+	ID_EX.B = NEXT_STATE.REGS[RT(instruction)];
+	ID_EX.imm = SIMM(instruction);
+#if MU_BREAK
+	if (IF_ID.flags & PREDECODED_BREAK) {
+		breakpoint_check(IF_ID.PC, FALSE);
+	}
+#endif
+}
+
+#if MU_FORWARDING
+/************************************************************/
+/* read a source operand in EX, forwarding from MEM/WB if needed      */ 
+/************************************************************/
+uint32_t forward_operand(uint8_t reg)
+{
+	/*MEM ran before EX this cycle, so MEM_WB holds the next older instruction*/
+	Inst_Deps older = decode_deps(MEM_WB.IR);
+	
+	if (older.kind == INST_ALU && older.dest == reg) {
+		return MEM_WB.ALUOutput;
+	}
+	return NEXT_STATE.REGS[reg];
 }
+#endif
 
 /************************************************************/
 /* instruction fetch (IF) pipeline stage:                                                              */ 
 /************************************************************/
 void IF()
 {
-	ID_IF.IR = mem_read_32(CURRENT_STATE.PC)
-	ID_IF.PC = CURRENT_STATE.PC; //putting program counter into pipeline regs DON'T KNOW IF NEEDED YET
-	CURRENT_STATE.PC = CURRENT_STATE.PC + 4; //incrementing program counter by four
-	/*IMPLEMENT THIS*/
+	uint32_t index;
+	
+	if (PIPE_STALL) {
+		return; /*hold IF/ID and the PC*/
+	}
+	if (PIPE_FLUSH) {
+		memset(&IF_ID, 0, sizeof(IF_ID)); /*fetch resumes at the branch target next cycle*/
+		return;
+	}
+	index = (CURRENT_STATE.PC - MEM_TEXT_BEGIN) >> 2;
+	memset(&IF_ID, 0, sizeof(IF_ID));
+	if (index < TEXT_TABLE_SIZE && (CURRENT_STATE.PC & 3) == 0) {
+		IF_ID.IR = TEXT_TABLE[index].IR;
+#if MU_BREAK
+		IF_ID.flags = TEXT_TABLE[index].flags;
+#endif
+	}
+	else {
+		IF_ID.IR = mem_read_32(CURRENT_STATE.PC);
+	}
+	IF_ID.PC = CURRENT_STATE.PC;
+	IF_ID.valid = TRUE;
+	NEXT_STATE.PC = CURRENT_STATE.PC + 4;
+#if MU_SWEEP
+	if (SWEEP_ACTIVE) {
+		sweep_access(&SWEEP_STREAMS[SWEEP_INST], CURRENT_STATE.PC);
+	}
+#endif
 }
 
 
@@ -375,17 +3020,50 @@ void IF()
 void initialize() { 
 	init_memory();
 	CURRENT_STATE.PC = MEM_TEXT_BEGIN;
+	HEAP_END = MEM_HEAP_BEGIN;
 	NEXT_STATE = CURRENT_STATE;
 	RUN_FLAG = TRUE;
+	UNDO(undo_configure(UNDO_DEFAULT_WINDOW));
+}
+
+/************************************************************/
+/* Build a mask with bits a through b (inclusive) set                                           */ 
+/************************************************************/
+unsigned createMask(unsigned a, unsigned b)
+{
+	unsigned r = 0;
+	unsigned i;
+	for (i = a; i <= b; i++) {
+		r |= 1u << i;
+	}
+	return r;
+}
+
+/************************************************************/
+/* Keep only the masked bits of an instruction                                                   */ 
+/************************************************************/
+unsigned applyMask(unsigned mask, uint32_t instruction)
+{
+	return mask & instruction;
 }
 
 /************************************************************/
 /* Print the program loaded into memory (in MIPS assembly format)    */ 
 /************************************************************/
 void print_program(){
-	/*IMPLEMENT THIS*/
+	uint32_t i, addr;
 	
-	//From lab 1, need to fix leading zeroes problem
+	for (i = 0; i < PROGRAM_SIZE; i++) {
+		addr = MEM_TEXT_BEGIN + (i * 4);
+		printf("[0x%08x]\t", addr);
+		print_instruction(addr);
+	}
+}
+
+/************************************************************/
+/* Print the instruction at addr (in MIPS assembly format)                               */ 
+/************************************************************/
+void print_instruction(uint32_t addr){
 	uint32_t instruction = (mem_read_32(addr)); //reading in address from mem
 	
 	//creating bit massk
@@ -395,25 +3073,25 @@ void print_program(){
 	unsigned imm_mask = createMask(0,15);	
 	unsigned base_mask = createMask(21,25);
 	unsigned offset_mask = createMask(0,15);
-	unsigned target_mask = createMask(0,26);	
+	unsigned target_mask = createMask(0,25);	
 	unsigned sa_mask = createMask(6,10);
 	unsigned branch_mask = createMask(16,20);	
 	unsigned func_mask = createMask(0,5);
 	unsigned rd_mask = createMask(11,15);
 	
 
-	//applying masks to get parts of command	
+	//applying masks to get parts of command, register fields are shifted down to their number
 	unsigned opcode = applyMask(opcode_mask, instruction);
-	unsigned rs = applyMask(rs_mask, instruction);
-	unsigned rt = applyMask(rt_mask, instruction);
+	unsigned rs = applyMask(rs_mask, instruction) >> 21;
+	unsigned rt = applyMask(rt_mask, instruction) >> 16;
 	unsigned immediate = applyMask(imm_mask, instruction);
-	unsigned base = applyMask(base_mask, instruction);
+	unsigned base = applyMask(base_mask, instruction) >> 21;
 	unsigned offset = applyMask(offset_mask, instruction);
-	unsigned target = applyMask(target_mask, instruction);
-	unsigned sa = applyMask(sa_mask, instruction);
+	unsigned target = applyMask(target_mask, instruction) << 2;
+	unsigned sa = applyMask(sa_mask, instruction) >> 6;
 	unsigned branch = applyMask(branch_mask, instruction);
 	unsigned func = applyMask(func_mask, instruction);
-	unsigned rd = applyMask(rd_mask, instruction);
+	unsigned rd = applyMask(rd_mask, instruction) >> 11;
 	
 	//printf("opcode = %x      ", opcode);
 	
@@ -422,37 +3100,37 @@ void print_program(){
 		case 0x20000000: //add ADDI
 		{
 			printf("ADDI ");
-			printf("$%x $%x 0x%x\n", rs, rt, immediate); 
+			printf("$%x $%x 0x%x\n", rt, rs, immediate); 
 			break;
 		}	
 		case 0x24000000: //ADDIU
 		{
 			printf("ADDIU ");
-			printf("$%x $%x 0x%04x\n", rs, rt, immediate); 
+			printf("$%x $%x 0x%04x\n", rt, rs, immediate); 
 			break;
 		}	
 		case 0x30000000: //ANDI
 		{
 			printf("ANDI ");
-			printf("$%x $%x 0x%x\n", rs, rt, immediate); 
+			printf("$%x $%x 0x%x\n", rt, rs, immediate); 
 			break;
 		}
 		case 0x34000000: //ORI
 		{
 			printf("ORI ");
-			printf("$%x $%x, 0x%04x\n", rs, rt, immediate); 
+			printf("$%x $%x 0x%04x\n", rt, rs, immediate); 
 			break;
 		}
 		case 0x38000000: //XORI
 		{
 			printf("XORI ");
-			printf("$%x $%x 0x%x\n", rs, rt, immediate);
+			printf("$%x $%x 0x%x\n", rt, rs, immediate);
 			break; 
 		}
-		case 0x28000000: //STLI set on less than immediate
+		case 0x28000000: //SLTI set on less than immediate
 		{
-			printf("STLI ");
-			printf("$%x $%x 0x%x\n", rs, rt, immediate); 
+			printf("SLTI ");
+			printf("$%x $%x 0x%x\n", rt, rs, immediate); 
 			break;
 		}
 		case 0x8C000000: //Load Word - for now on is load/store instructions mostly
@@ -464,13 +3142,13 @@ void print_program(){
 		case 0x80000000: //Load Byte LB
 		{
 			printf("LB ");
-			printf("$%x, 0x%x $%x\n", rt, offset, base); 
+			printf("$%x 0x%x $%x\n", rt, offset, base); 
 			break;
 		}
 		case 0x84000000: //Load halfword
 		{
 			printf("LH ");
-			printf("$%x 0x%x $%x)\n", rt, offset, base); 
+			printf("$%x 0x%x $%x\n", rt, offset, base); 
 			break;
 		}
 		case 0x3C000000: //LUI Load Upper Immediate, was 0F
@@ -494,7 +3172,7 @@ void print_program(){
 		case 0xA4000000: //SH Store Halfword CHECK FORMAT
 		{
 			printf("SH ");
-			printf("$%x 0x%x $%x)\n", rt, offset, base); 
+			printf("$%x 0x%x $%x\n", rt, offset, base); 
 			break;
 		}
 		case 0x10000000: //BEQ Branch if equal - start of branching instructions
@@ -522,7 +3200,7 @@ void print_program(){
 				case 0x00: //BLTZ Brnach on Less than zero
 				{
 					printf("BLTZ ");
-					printf("#%x 0x%x\n", rs, offset); 
+					printf("$%x 0x%x\n", rs, offset); 
 					break;
 				}
 				case 0x10000: // BGEZ Branch on greater than or equal zero
@@ -537,20 +3215,20 @@ void print_program(){
 		}
 		case 0x1C000000: //BGTZ Branch on Greater than Zero
 		{
-			printf("BLEZ ");
+			printf("BGTZ ");
 			printf("$%x 0x%x\n", rs, offset); 
 			break;
 		}
 		case 0x08000000: //Jump J (bum bum bummmm bum, RIP Eddie VanHalen)
 		{
 			printf("J ");
-			printf("0x%x\n", (addr & 0xF0000000) | (target));
+			printf("0x%x\n", ((addr + 4) & 0xF0000000) | (target));
 			break;
 		}
 		case 0x0C000000: //JAL Jump and Link
 		{
 			printf("JAL ");
-			printf("0x%x\n", (addr & 0xF0000000) | (target));
+			printf("0x%x\n", ((addr + 4) & 0xF0000000) | (target));
 			break;
 		}
 		case 0x00000000: //special case when first six bits are 000000, function operations
@@ -661,31 +3339,31 @@ void print_program(){
 				}
 				case 0x12: //MFLO Move from LO
 				{
-					printf("MFHI ");
+					printf("MFLO ");
 					printf("$%x\n", rd); //only the rd register
 					break;
 				}
 				case 0x11: //MTHI Move to HI
 				{
-					printf("MFHI ");
+					printf("MTHI ");
 					printf("$%x\n", rs); //only the rs register
 					break;
 				}
 				case 0x13: //MTLO Move to LO
 				{
-					printf("MFHI ");
+					printf("MTLO ");
 					printf("$%x\n", rs); //only the rs register
 					break;
 				}
 				case 0x08: //JR Jump Register
 				{
 					printf("JR ");
-					printf("%x\n", rs); //only the rs register
+					printf("$%x\n", rs); //only the rs register
 					break;
 				}
-				case 0x09: //JALR Jump and Link Register CHECK FORMAT
+				case 0x09: //JALR Jump and Link Register
 				{
-					printf("JR ");
+					printf("JALR ");
 					if(rd == 0x1F) //if rd is all one's (or 31) then not given
 					{
 						printf("$%x\n", rs);
@@ -704,6 +3382,17 @@ void print_program(){
 			
 			break;
 		}			
+		case 0x40000000: //COP0, MFC0/MTC0
+		{
+			if (rs == 0x04) {
+				printf("MTC0 ");
+			}
+			else {
+				printf("MFC0 ");
+			}
+			printf("$%x $%x %x\n", rt, rd, instruction & 0x7);
+			break;
+		}
 		default:
 		{
 			printf("Command not found...\n");
@@ -717,11 +3406,9 @@ void print_program(){
 /* Print the current pipeline                                                                                    */ 
 /************************************************************/
 void show_pipeline(){
-	/*IMPLEMENT THIS*/
-	//ID_RF part of the lab
-	printf("Current PC: %x\n", CURRENT_STATE.PC); //may need to be one the one from the pipeline regs
-	printf("IF/ID %x\n", ID_ID.IR); //double check data type and what not for this one
-	printf("IF/ID.PC %x\n", ID_IF.PC);
+	printf("Current PC: %x\n", CURRENT_STATE.PC);
+	printf("IF/ID.IR %x\n", IF_ID.IR);
+	printf("IF/ID.PC %x\n", IF_ID.PC);
 	
 	//EX part
 	printf("ID/EX.IR %x\n", ID_EX.IR);
@@ -732,14 +3419,25 @@ void show_pipeline(){
 	//MEM
 	printf("EX/MEM.IR %x\n", EX_MEM.IR);
 	printf("EX/MEM.A %x\n", EX_MEM.A);
-	printf("EX?MEM.B %x\n", EX_MEM.B);
-	printf("ALUOutput %x\n", EX_MEM.ALUOutput);
+	printf("EX/MEM.B %x\n", EX_MEM.B);
+	printf("EX/MEM.ALUOutput %x\n", EX_MEM.ALUOutput);
 	
 	//WB
 	printf("MEM/WB.IR %x\n", MEM_WB.IR);
 	printf("MEM/WB.ALUOutput %x\n", MEM_WB.ALUOutput);
 	printf("MEM/WB.LMD %x\n", MEM_WB.LMD);
-	
+	printf("\n");
+}
+
+/***************************************************************/
+/* Print the features this binary was built with                                                     */
+/***************************************************************/
+void print_features() {
+	printf("Build features:");
+#define PRINT_FEATURE(name, enabled) printf(" %s%s", (enabled) ? "+" : "-", #name);
+	MU_FEATURES(PRINT_FEATURE)
+#undef PRINT_FEATURE
+	printf("\n\n");
 }
 
 /***************************************************************/
@@ -749,13 +3447,17 @@ int main(int argc, char *argv[]) {
 	printf("\n**************************\n");
 	printf("Welcome to MU-MIPS SIM...\n");
 	printf("**************************\n\n");
+	print_features();
 	
 	if (argc < 2) {
 		printf("Error: You should provide input file.\nUsage: %s <input program> \n\n",  argv[0]);
 		exit(1);
 	}
 
-	strcpy(prog_file, argv[1]);
+	if (snprintf(prog_file, sizeof(prog_file), "%s", argv[1]) >= (int)sizeof(prog_file)) {
+		printf("Error: Program path is longer than %d characters\n\n", PROG_FILE_SIZE - 1);
+		exit(1);
+	}
 	initialize();
 	load_program();
 	help();
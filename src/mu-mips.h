@@ -3,6 +3,63 @@
 #define FALSE 0
 #define TRUE  1
 
+/******************************************************************************/
+/* Build configuration: override with -DMU_<FEATURE>=0/1 (see "make variants")                               */
+/******************************************************************************/
+#ifndef MU_FORWARDING
+#define MU_FORWARDING 1	/* EX/MEM and MEM/WB forwarding, otherwise interlock until WB */
+#endif
+#ifndef MU_PROFILE
+#define MU_PROFILE 1	/* stall/flush/instruction-mix counters shown by rdump */
+#endif
+#ifndef MU_TRACE
+#define MU_TRACE 0	/* per-cycle pipeline trace on stderr */
+#endif
+#ifndef MU_UNDO
+#define MU_UNDO 1	/* undo log behind the back/rstep commands */
+#endif
+#ifndef MU_BREAK
+#define MU_BREAK 1	/* breakpoints and watchpoints */
+#endif
+#ifndef MU_CAPTURE
+#define MU_CAPTURE 1	/* retired-instruction trace capture for replay */
+#endif
+#ifndef MU_SWEEP
+#define MU_SWEEP 1	/* single-pass cache sweep over the reference stream */
+#endif
+#ifndef MU_SLICE
+#define MU_SLICE 1	/* time-parallel detailed simulation over checkpoint slices */
+#endif
+
+#define MU_FEATURES(X) \
+	X(FORWARDING, MU_FORWARDING) \
+	X(PROFILE, MU_PROFILE) \
+	X(TRACE, MU_TRACE) \
+	X(UNDO, MU_UNDO) \
+	X(BREAK, MU_BREAK) \
+	X(CAPTURE, MU_CAPTURE) \
+	X(SWEEP, MU_SWEEP) \
+	X(SLICE, MU_SLICE)
+
+/* instrumentation hooks compile to nothing when their feature is disabled */
+#if MU_PROFILE
+#define PROFILE(stmt) do { stmt; } while (0)
+#else
+#define PROFILE(stmt) do { } while (0)
+#endif
+
+#if MU_TRACE
+#define TRACE(stmt) do { stmt; } while (0)
+#else
+#define TRACE(stmt) do { } while (0)
+#endif
+
+#if MU_UNDO
+#define UNDO(stmt) do { stmt; } while (0)
+#else
+#define UNDO(stmt) do { } while (0)
+#endif
+
 /******************************************************************************/
 /* MIPS memory layout                                                                                                                                      */
 /******************************************************************************/
@@ -22,6 +79,9 @@
 #define MEM_STACK_BEGIN 0x7FFFFFFF
 #define MEM_STACK_END  0x10010000
 
+/*heap handed out by the sbrk syscall starts where SPIM puts it */
+#define MEM_HEAP_BEGIN 0x10040000
+
 typedef struct {
 	uint32_t begin, end;
 	uint8_t *mem;
@@ -38,6 +98,24 @@ mem_region_t MEM_REGIONS[] = {
 #define NUM_MEM_REGION 4
 #define MIPS_REGS 32
 
+/* predecoded copy of the loaded program, IF fetches from here instead of searching the regions */
+typedef struct Predecoded_Struct {
+	uint32_t IR;
+	uint32_t flags;	/* PREDECODED_* */
+} Predecoded;
+
+#define PREDECODED_BREAK 0x1	/* a breakpoint is set on this instruction */
+#define PREDECODED_BREAK_LATE 0x2	/* pipeline only: a breakpoint condition waits for MEM */
+
+Predecoded *TEXT_TABLE;
+uint32_t TEXT_TABLE_SIZE; /*in words*/
+
+#if MU_BREAK
+/* watchpoints flag whole pages so that only accesses to watched pages take the slow path */
+#define WATCH_PAGE_BITS 12
+uint8_t WATCH_PAGES[1 << (32 - WATCH_PAGE_BITS)];
+#endif
+
 typedef struct CPU_State_Struct {
 
   uint32_t PC;		                   /* program counter */
@@ -46,6 +124,7 @@ typedef struct CPU_State_Struct {
 } CPU_State;
 
 typedef struct CPU_Pipeline_Reg_Struct{
+	uint32_t valid; /* FALSE for a bubble, IR 0 is a real nop */
 	uint32_t PC;
 	uint32_t IR;
 	uint32_t A;
@@ -53,9 +132,50 @@ typedef struct CPU_Pipeline_Reg_Struct{
 	uint32_t imm;
 	uint32_t ALUOutput;
 	uint32_t LMD;
+	uint32_t HI, LO; /* mult/div results, written to HI/LO in WB */
+	uint32_t taken; /* branch/jump redirected fetch in EX */
+#if MU_BREAK
+	uint32_t flags; /* PREDECODED_* flags of the fetched instruction */
+#endif
 	
 } CPU_Pipeline_Reg;
 
+/***************************************************************/
+/* Instruction fields                                                                                                         */
+/***************************************************************/
+#define OPCODE(ir)	(((ir) >> 26) & 0x3F)
+#define RS(ir)		(((ir) >> 21) & 0x1F)
+#define RT(ir)		(((ir) >> 16) & 0x1F)
+#define RD(ir)		(((ir) >> 11) & 0x1F)
+#define SA(ir)		(((ir) >> 6) & 0x1F)
+#define FUNCT(ir)	((ir) & 0x3F)
+#define IMM(ir)		((ir) & 0xFFFF)
+#define SIMM(ir)	((uint32_t)(int32_t)(int16_t)((ir) & 0xFFFF))
+#define TARGET(ir)	((ir) & 0x03FFFFFF)
+
+/* pseudo register number used for HI/LO in hazard detection */
+#define REG_HILO 32
+
+/* how an instruction's result becomes available to younger instructions */
+#define INST_NONE	0	/* no register result (stores, branches, bubbles) */
+#define INST_ALU	1	/* result ready at the end of EX */
+#define INST_LOAD	2	/* result ready at the end of MEM */
+#define INST_LATE	3	/* result only visible after WB (HI/LO writes, syscall) */
+
+typedef struct Inst_Deps_Struct {
+	uint8_t src1, src2;	/* source registers, 0 if unused */
+	uint8_t dest;		/* destination register, 0 if none */
+	uint8_t kind;		/* INST_* */
+} Inst_Deps;
+
+/* what an instruction computes, before MEM and WB apply it */
+typedef struct Alu_Result_Struct {
+	uint32_t value;		/* GPR result, or a load/store's effective address */
+	uint32_t HI, LO;	/* unchanged unless the instruction writes them */
+	uint32_t target;	/* next PC of a taken branch or jump */
+	int taken;
+} Alu_Result;
+
 /***************************************************************/
 /* CPU State info.                                                                                                               */
 /***************************************************************/
@@ -65,17 +185,257 @@ int RUN_FLAG;	/* run flag*/
 uint32_t INSTRUCTION_COUNT;
 uint32_t CYCLE_COUNT;
 uint32_t PROGRAM_SIZE; /*in words*/
+uint32_t HEAP_END; /* current program break for sbrk */
+
+#if MU_PROFILE
+uint32_t STALL_COUNT;	/* cycles ID held an instruction back */
+uint32_t FLUSH_COUNT;	/* taken branches/jumps that squashed the fetch */
+uint32_t LOAD_COUNT, STORE_COUNT, BRANCH_COUNT; /* retired instruction mix */
+#endif
+
+/***************************************************************/
+/* Coprocessor 0 performance counters, read/written with MFC0/MTC0   */
+/* A counter reads as the host count less its base, so MTC0 only moves    */
+/* the base and the cycle loop keeps its plain increments.                         */
+/* Under slice the guest runs in the functional fast-forward, so cycles  */
+/* there are modelled (no stalls) and stall cycles do not advance.          */
+/***************************************************************/
+#define CP0_COUNT 9		/* $9 sel 0: Count, same as PerfCnt sel 0 */
+#define CP0_PERF 25		/* $25 sel n: counter n below */
+#define CP0_CYCLES 0
+#define CP0_INSTRUCTIONS 1	/* retired before the MFC0 */
+#define CP0_STALLS 2		/* needs MU_PROFILE, reads 0 otherwise */
+#define CP0_MISPREDICTS 3	/* taken branches/jumps, needs MU_PROFILE */
+#define CP0_CACHE_MISSES 4	/* no cache is modelled, always 0 */
+#define CP0_COUNTERS 5
+
+uint32_t CP0_BASE[CP0_COUNTERS];
 
 
 /***************************************************************/
 /* Pipeline Registers.                                                                                                        */
 /***************************************************************/
-CPU_Pipeline_Reg ID_IF;
-CPU_Pipeline_Reg IF_EX;
+CPU_Pipeline_Reg IF_ID;
+CPU_Pipeline_Reg ID_EX;
 CPU_Pipeline_Reg EX_MEM;
 CPU_Pipeline_Reg MEM_WB;
 
-char prog_file[32];
+int PIPE_STALL;	/* ID detected a hazard this cycle: hold IF/ID and the PC */
+int PIPE_FLUSH;	/* EX redirected the PC this cycle: squash IF/ID */
+
+#if MU_UNDO
+/***************************************************************/
+/* Undo log: periodic checkpoints of the core plus per-cycle memory deltas */
+/* Rewinding restores memory and the nearest older checkpoint, then          */
+/* re-simulates forward to the target cycle.                                                  */
+/***************************************************************/
+#define UNDO_DEFAULT_WINDOW (1 << 16)	/* cycles of history kept */
+#define UNDO_CHECKPOINTS 16			/* checkpoints per window */
+
+typedef struct Core_State_Struct {
+	CPU_State state;
+	CPU_Pipeline_Reg IF_ID, ID_EX, EX_MEM, MEM_WB;
+	uint32_t INSTRUCTION_COUNT, CYCLE_COUNT, HEAP_END;
+	uint32_t CP0_BASE[CP0_COUNTERS];
+	int RUN_FLAG;
+#if MU_PROFILE
+	uint32_t STALL_COUNT, FLUSH_COUNT, LOAD_COUNT, STORE_COUNT, BRANCH_COUNT;
+#endif
+} Core_State;
+
+typedef struct Undo_Delta_Struct {
+	uint32_t address;	/* memory word overwritten */
+	uint32_t old;		/* its value before the write */
+} Undo_Delta;
+
+typedef struct Undo_Frame_Struct {
+	uint32_t start;		/* first delta of the cycle (absolute index) */
+	int has_input;		/* a read int syscall retired this cycle */
+	int input;		/* and returned this value */
+} Undo_Frame;
+
+uint32_t UNDO_WINDOW;		/* frames kept, 0 disables the log */
+uint32_t UNDO_INTERVAL;		/* cycles between checkpoints */
+Undo_Frame *UNDO_FRAMES;	/* ring indexed by cycle % UNDO_WINDOW */
+Undo_Delta *UNDO_DELTAS;	/* ring indexed by absolute delta % UNDO_DELTA_SIZE */
+uint32_t UNDO_DELTA_SIZE;
+uint32_t UNDO_DELTA_BEGIN, UNDO_DELTA_END;
+Core_State *UNDO_CHECKPOINT;	/* oldest first, UNDO_CHECKPOINT_COUNT valid */
+uint32_t UNDO_CHECKPOINT_SIZE, UNDO_CHECKPOINT_COUNT;
+uint32_t UNDO_FIRST_CYCLE;	/* oldest cycle that can be rewound to */
+int UNDO_RECORDING;		/* inside cycle() with the log enabled */
+int UNDO_OVERFLOW;		/* a cycle wrote more than the delta ring holds */
+int UNDO_REPLAYING;		/* re-simulating after a rewind: mute output, replay input */
+int *UNDO_REPLAY_INPUT;		/* read int results indexed by cycle - UNDO_REPLAY_BASE */
+uint32_t UNDO_REPLAY_BASE;
+#endif
+
+#if MU_BREAK
+/***************************************************************/
+/* Breakpoints and watchpoints                                                                                */
+/***************************************************************/
+#define MAX_BREAKPOINTS 32
+
+typedef struct Breakpoint_Struct {
+	uint32_t address;	/* instruction address, or watched word */
+	int watch;		/* TRUE for a watchpoint */
+	int conditional;	/* only stop when REGS[reg] == value */
+	uint32_t reg, value;
+} Breakpoint;
+
+Breakpoint BREAKPOINTS[MAX_BREAKPOINTS];
+int NUM_BREAKPOINTS;
+int BREAK_HIT;	/* stop run/sim after the current cycle */
+#endif
+
+/***************************************************************/
+/* Retired-instruction traces                                                                                   */
+/* File layout: Trace_Header, the program image (text_words words) and  */
+/* a byte stream of records. Decoded fields and register dependencies   */
+/* are recomputed from the instruction word, so a record only carries     */
+/* what the image cannot tell: non-sequential PCs, instructions that        */
+/* differ from the image, effective addresses and branch outcomes.        */
+/* Runs of plain sequential records collapse into one TRACE_RUN byte.  */
+/***************************************************************/
+#define TRACE_MAGIC	0x5254554D	/* "MUTR" */
+#define TRACE_VERSION	1
+
+#define TRACE_PC	0x01	/* zigzag varint: PC - (previous PC + 4) */
+#define TRACE_IR	0x02	/* 4 bytes: instruction word */
+#define TRACE_MEM	0x04	/* zigzag varint: address - previous address */
+#define TRACE_TAKEN	0x08	/* branch/jump redirected fetch */
+#define TRACE_RUN	0x80	/* low 7 bits: number of plain sequential records */
+
+typedef struct Trace_Header_Struct {
+	uint32_t magic, version;
+	uint32_t text_begin, text_words;	/* program image following the header */
+	uint32_t records;			/* retired instructions */
+	uint32_t cycles;			/* cycles the pipeline took for them */
+	uint32_t forwarding;			/* MU_FORWARDING of the capturing build */
+	uint32_t data_bytes;			/* size of the record stream */
+} Trace_Header;
+
+typedef struct Trace_Record_Struct {
+	uint32_t PC, IR, address;
+	int taken;
+} Trace_Record;
+
+/* timing model configuration evaluated by the replay engine */
+typedef struct Replay_Config_Struct {
+	int forwarding;
+	int btfn;		/* predict backward taken/forward not taken, else not taken */
+	uint32_t penalty;	/* bubbles after a mispredicted branch */
+	uint32_t cycles, stalls, mispredicts;
+	uint32_t ready[MIPS_REGS + 1];	/* ID cycle of the last writer of each register */
+	uint8_t kind[MIPS_REGS + 1];	/* and how its result becomes available */
+	uint32_t last;			/* ID cycle of the previous instruction */
+	uint32_t redirect;		/* earliest ID cycle after a taken/mispredicted branch */
+} Replay_Config;
+
+#if MU_CAPTURE
+FILE *CAPTURE_FILE;
+Trace_Header CAPTURE_HEADER;
+uint32_t *CAPTURE_IMAGE;
+uint32_t CAPTURE_NEXT_PC, CAPTURE_LAST_ADDRESS, CAPTURE_RUN;
+uint32_t CAPTURE_START_CYCLE;
+#endif
+
+#if MU_SWEEP
+/***************************************************************/
+/* Cache sweep: per-set LRU stacks for every power-of-two set count give */
+/* the stack distance of each reference, and a stack distance histogram */
+/* yields the miss ratio of every associativity at once.                            */
+/***************************************************************/
+#define SWEEP_BLOCK_BITS 5	/* 32-byte blocks */
+#define SWEEP_SET_BITS 10	/* 1 to 1024 sets */
+#define SWEEP_MAX_ASSOC 16	/* deepest stack position tracked per set */
+#define SWEEP_INST 0
+#define SWEEP_DATA 1
+
+typedef struct Sweep_Stream_Struct {
+	uint32_t *stacks[SWEEP_SET_BITS + 1];	/* sets * SWEEP_MAX_ASSOC blocks (+1, 0 = empty), MRU first */
+	uint64_t distance[SWEEP_SET_BITS + 1][SWEEP_MAX_ASSOC + 1]; /* last bucket: cold or deeper */
+	uint64_t accesses;
+} Sweep_Stream;
+
+Sweep_Stream SWEEP_STREAMS[2];
+int SWEEP_ACTIVE;
+char SWEEP_PATH[256];
+#endif
+
+/***************************************************************/
+/* Batched functional mode: many guest instances in lockstep                 */
+/* Registers are stored lane-major (REGS[r][lane]) so one decoded           */
+/* instruction runs as a vectorizable loop over the lanes. Lanes whose     */
+/* control flow diverged wait until the lowest PC catches up with them.  */
+/***************************************************************/
+#define BATCH_MAX_LANES 4096
+#define BATCH_PAGE_BITS 12
+
+/* lane kernels are compiled for each ISA and picked at load time */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define BATCH_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define BATCH_CLONES
+#endif
+
+typedef struct Batch_Pages_Struct {
+	uint32_t *keys;		/* page number + 1, 0 = empty slot */
+	uint8_t **data;		/* private copy of the page */
+	uint32_t size, used;	/* open addressing, size is a power of two */
+} Batch_Pages;
+
+typedef struct Batch_State_Struct {
+	uint32_t lanes;
+	uint32_t *REGS[MIPS_REGS];
+	uint32_t *HI, *LO, *PC, *HEAP;
+	uint32_t *mask;		/* ~0 for lanes executing the current instruction */
+	uint32_t *count;	/* retired instructions per lane */
+	uint32_t *done;		/* lane executed the exit syscall */
+	uint32_t *cp0_base[CP0_COUNTERS];	/* only cycles/instructions are used, both count retired instructions */
+	Batch_Pages *pages;	/* per-lane copy-on-write memory */
+} Batch_State;
+
+#if MU_SLICE
+/***************************************************************/
+/* Time-parallel simulation: a functional fast-forward forks a checkpoint */
+/* process at each slice boundary (less the warm-up), and each checkpoint */
+/* runs the detailed pipeline over its slice once it has been released.   */
+/***************************************************************/
+#define SLICE_OFF 0
+#define SLICE_FORWARD 1		/* parent: functional fast-forward, records read-int input */
+#define SLICE_DETAILED 2	/* child: detailed slice, replays the recorded input */
+
+typedef struct Slice_Hold_Struct {
+	pid_t pid;
+	uint32_t slice;
+	uint32_t end;		/* released once the fast-forward retires this many instructions */
+	int input;		/* write end of the child's read-int pipe */
+} Slice_Hold;
+
+typedef struct Slice_Result_Struct {
+	pid_t pid;
+	uint32_t slice;
+	uint32_t instructions, cycles;	/* measured part only, warm-up excluded */
+	uint32_t stalls, flushes, loads, stores, branches;
+} Slice_Result;
+
+int SLICE_MODE;
+Slice_Hold *SLICE_HOLDS;	/* checkpoints waiting for their input, oldest first */
+uint32_t SLICE_HOLD_COUNT;
+int *SLICE_INPUT;		/* read-int values replayed by a detailed slice */
+uint32_t SLICE_INPUT_COUNT, SLICE_INPUT_NEXT;
+#endif
+
+/***************************************************************/
+/* Guest console output, flushed to stdout in bulk                                                    */
+/***************************************************************/
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+char OUTPUT_BUFFER[OUTPUT_BUFFER_SIZE];
+uint32_t OUTPUT_LENGTH;
+
+#define PROG_FILE_SIZE 4096
+char prog_file[PROG_FILE_SIZE];
 
 
 /***************************************************************/
@@ -84,6 +444,18 @@ char prog_file[32];
 void help();
 uint32_t mem_read_32(uint32_t address);
 void mem_write_32(uint32_t address, uint32_t value);
+uint8_t mem_read_8(uint32_t address);
+void mem_write_8(uint32_t address, uint8_t value);
+void output_flush();
+void output_write(const char *str, uint32_t len);
+void handle_syscall();
+Inst_Deps decode_deps(uint32_t instruction);
+uint32_t mem_access(uint32_t instruction, uint32_t address, uint32_t value);
+Alu_Result alu_execute(uint32_t instruction, uint32_t pc, uint32_t a, uint32_t b, uint32_t hi, uint32_t lo);
+void alu_divide(uint32_t a, uint32_t b, int is_signed, uint32_t *hi, uint32_t *lo);
+int depends_on(Inst_Deps consumer, Inst_Deps producer);
+int cp0_index(uint32_t instruction);
+uint32_t cp0_counter(int index);
 void cycle();
 void run(int num_cycles);
 void runAll();
@@ -93,13 +465,66 @@ void handle_command();
 void reset();
 void init_memory();
 void load_program();
-void handle_pipeline(); /*IMPLEMENT THIS*/
-void WB();/*IMPLEMENT THIS*/
-void MEM();/*IMPLEMENT THIS*/
-void EX();/*IMPLEMENT THIS*/
-void ID();/*IMPLEMENT THIS*/
-void IF();/*IMPLEMENT THIS*/
-void show_pipeline();/*IMPLEMENT THIS*/
+void handle_pipeline();
+void WB();
+void MEM();
+void EX();
+void ID();
+void IF();
+void show_pipeline();
 void initialize();
-void print_program(); /*IMPLEMENT THIS*/
+void print_program();
+void print_features();
+void predecode_program();
+#if MU_CAPTURE
+void capture_open(const char *path);
+void capture_close();
+void capture_retire();
+void capture_byte(uint8_t value);
+void capture_varint(uint32_t value);
+#endif
+#if MU_SWEEP
+void sweep_start(const char *path);
+void sweep_access(Sweep_Stream *stream, uint32_t address);
+void sweep_finish();
+#endif
+void replay_trace(const char *path);
+#if MU_SLICE
+void functional_run(uint32_t limit);
+void slice_record_input(int value);
+void slice_child(uint32_t slice, uint32_t begin, uint32_t end, int input, int result);
+void slice_collect(Slice_Result **results, uint32_t *size, const Slice_Result *r);
+void run_slices(uint32_t length, uint32_t warmup);
+#endif
+void run_batch(uint32_t lanes, uint32_t reg, uint32_t start, uint32_t step);
+void batch_execute(Batch_State *b, uint32_t pc, uint32_t instruction);
+uint8_t *batch_page(Batch_State *b, uint32_t lane, uint32_t address, int write);
+uint32_t batch_read_32(Batch_State *b, uint32_t lane, uint32_t address);
+void batch_write_32(Batch_State *b, uint32_t lane, uint32_t address, uint32_t value);
+void batch_syscall(Batch_State *b, uint32_t lane);
+uint32_t trace_varint(const uint8_t **p, const uint8_t *end);
+void replay_step(Replay_Config *config, const Trace_Record *record, Inst_Deps deps);
+#if MU_BREAK
+void breakpoint_add(uint32_t address, int watch, int conditional, uint32_t reg, uint32_t value);
+void breakpoint_delete(uint32_t address);
+void breakpoint_sync();
+int breakpoint_register(uint32_t reg, uint32_t *value);
+void breakpoint_check(uint32_t pc, int late);
+void watchpoint_check(uint32_t address, uint32_t size, int write);
+#endif
+#if MU_UNDO
+void save_core(Core_State *core);
+void restore_core(const Core_State *core);
+void undo_configure(uint32_t window);
+void undo_clear();
+int undo_evict();
+void undo_begin_cycle();
+void undo_record_write(uint32_t address, uint32_t old);
+void undo_record_input(int value);
+void undo_back(uint32_t cycles);
+#endif
+uint32_t forward_operand(uint8_t reg);
+void print_instruction(uint32_t addr);
+unsigned createMask(unsigned a, unsigned b);
+unsigned applyMask(unsigned mask, uint32_t instruction);
 